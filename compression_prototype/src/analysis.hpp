@@ -1,5 +1,3 @@
-#include <numeric> // for std::iota
-
 #pragma once
 #include "fft.hpp"
 #include <vector>
@@ -12,32 +10,82 @@ struct Peak {
     int bin;
     float mag;
     float phase;
+    float freq = 0.0f;  // refined frequency, in bins
+    float score = 0.0f; // selection rank, higher is kept first
 };
 
-inline void mag_phase(const std::vector<cpx>& X, std::vector<float>& mag, std::vector<float>& ph){
-    size_t N = X.size();
-    mag.resize(N/2+1);
-    ph.resize(N/2+1);
-    for(size_t k=0;k<=N/2;++k){
-        mag[k] = std::abs(X[k]);
-        ph[k]  = std::arg(X[k]);
+// |X[k]|^2 for bins 0..N/2. Only squares and adds over the interleaved
+// re/im floats (std::complex is laid out as float[2]), so the loop
+// vectorises; sqrt and atan2 are left to the few bins that become peaks.
+inline void power_spectrum(const std::vector<cpx>& X, std::vector<float>& pw){
+    size_t n = X.size()/2+1;
+    pw.resize(n);
+    const float* p = reinterpret_cast<const float*>(X.data());
+    float* out = pw.data();
+    for(size_t k=0;k<n;++k) out[k] = p[2*k]*p[2*k] + p[2*k+1]*p[2*k+1];
+}
+
+// Candidates below this fraction of the frame's strongest peak power are
+// ignored (-100 dB).
+constexpr float PEAK_FLOOR = 1e-10f;
+
+// Refine the local maximum p.bin by fitting a parabola through the log
+// powers of its bin and the two neighbours. The vertex gives the partial's
+// frequency as a fractional bin and its magnitude, which the bin value
+// understates by up to 1.4 dB (Hann) when the partial sits between bins.
+inline void parabolic_peak(const std::vector<float>& pw, Peak& p){
+    const int k = p.bin;
+    float a = std::log(pw[k-1] + 1e-30f), b = std::log(pw[k] + 1e-30f), c = std::log(pw[k+1] + 1e-30f);
+    float den = a - 2.0f*b + c;
+    float d = den < 0.0f ? std::min(0.5f, std::max(-0.5f, 0.5f*(a - c)/den)) : 0.0f;
+    p.freq = float(k) + d;
+    p.mag = std::exp(0.5f*(b - 0.25f*(a - c)*d));
+}
+
+// Keep the K best-scoring peaks (ties go to the lower bin), sorted by bin.
+inline void keep_strongest(std::vector<Peak>& peaks, int K){
+    if((int)peaks.size() > K){
+        std::nth_element(peaks.begin(), peaks.begin()+std::max(K,0), peaks.end(),
+            [](const Peak& a, const Peak& b){ return a.score > b.score || (a.score == b.score && a.bin < b.bin); });
+        peaks.resize(std::max(K,0));
     }
+    std::sort(peaks.begin(), peaks.end(), [](const Peak& a, const Peak& b){ return a.bin < b.bin; });
 }
 
-inline std::vector<Peak> topk_peaks(const std::vector<float>& mag, const std::vector<float>& ph, int K){
-    std::vector<int> idx(mag.size());
-    std::iota(idx.begin(), idx.end(), 0);
-    std::partial_sort(idx.begin(), idx.begin()+std::min<int>(K,idx.size()), idx.end(),
-        [&](int a,int b){ return mag[a] > mag[b]; });
-    std::vector<Peak> out;
-    int kk = std::min<int>(K, idx.size());
-    out.reserve(kk);
-    for(int i=0;i<kk;++i){
-        int k = idx[i];
-        out.push_back(Peak{ k, mag[k], ph[k] });
+// Peak candidates of a power spectrum: bins that are local maxima above
+// PEAK_FLOOR, so each partial is one candidate rather than its main-lobe
+// neighbours too. Candidates carry their power as score; magnitude and
+// phase are filled in by finish_peaks once selection is done. out is the
+// caller's buffer and is reused.
+inline void find_peaks(const std::vector<float>& pw, std::vector<Peak>& out){
+    out.clear();
+    float top = 0.0f;
+    for(int k=1;k+1<(int)pw.size();++k){
+        if(pw[k] > pw[k-1] && pw[k] >= pw[k+1]){
+            out.push_back(Peak{ k, 0.0f, 0.0f, 0.0f, pw[k] });
+            top = std::max(top, pw[k]);
+        }
     }
-    std::sort(out.begin(), out.end(), [](const Peak& a, const Peak& b){ return a.bin < b.bin; });
-    return out;
+    const float floor = PEAK_FLOOR * top;
+    out.erase(std::remove_if(out.begin(), out.end(), [&](const Peak& p){ return pw[p.bin] <= floor; }), out.end());
+}
+
+// refined magnitude and frequency, and the bin's phase, of the selected
+// peaks only
+inline void finish_peaks(const std::vector<float>& pw, const std::vector<cpx>& X, std::vector<Peak>& peaks){
+    for(auto& p: peaks){
+        parabolic_peak(pw, p);
+        p.phase = std::atan2(X[p.bin].imag(), X[p.bin].real());
+    }
+}
+
+// The K strongest spectral peaks of X given its power spectrum pw, ranked
+// on power.
+inline void topk_peaks(const std::vector<float>& pw, const std::vector<cpx>& X, int K,
+                       std::vector<Peak>& out){
+    find_peaks(pw, out);
+    keep_strongest(out, K);
+    finish_peaks(pw, X, out);
 }
 
 } // namespace wofl
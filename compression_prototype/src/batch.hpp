@@ -0,0 +1,324 @@
+#pragma once
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <iostream>
+#include <stdexcept>
+#include "wav.hpp"
+#include "wavmap.hpp"
+#include "resample.hpp"
+#include "bitstream.hpp"
+#include "lowdelay.hpp"
+#include "threadpool.hpp"
+
+namespace wofl {
+
+struct BatchJob {
+    std::string in;
+    std::string out;
+};
+
+// one "input output" pair per line; blank lines and '#' comments are skipped
+inline std::vector<BatchJob> read_manifest(const std::string &path) {
+    std::ifstream f(path);
+    if (!f) throw std::runtime_error("cannot open batch manifest");
+    std::vector<BatchJob> jobs;
+    std::string line;
+    while (std::getline(f, line)) {
+        std::istringstream ls(line);
+        BatchJob j;
+        if (!(ls >> j.in) || j.in[0] == '#') continue;
+        if (!(ls >> j.out)) throw std::runtime_error("manifest line without output: " + line);
+        jobs.push_back(j);
+    }
+    return jobs;
+}
+
+struct EncodeParams {
+    size_t nfft = 2048;
+    size_t hop = 512;
+    TrackSelect tracks;
+    float step = 0.004f;
+    size_t seg_frames = 0; // 0 = BATCH_SEGMENT_FRAMES in batch mode
+    RateParams rate;
+    bool psy = true;
+    bool pns = true;
+    PhaseQ phase;
+    uint32_t sbr_hz = 0; // 0 = code the full band
+    bool lossless = false;
+    bool low_delay = false; // hop 0 = low_delay_hop of each file's coded rate
+    int resample_hz = 0;    // code at this rate, 0 = each input's
+};
+
+// segment length used by batch mode when none is given, so long files are
+// split into frame ranges that idle workers can steal
+constexpr size_t BATCH_SEGMENT_FRAMES = 256;
+
+namespace detail {
+
+// per-worker buffers reused across every file and segment a thread touches
+struct BatchScratch {
+    BitWriter bw;
+    Planar pcm;
+    LosslessScratch lossless;
+};
+
+struct BatchReport {
+    std::mutex m;
+    std::atomic<size_t> failed{0};
+
+    void ok(const BatchJob &j, size_t bytes) {
+        std::lock_guard<std::mutex> lock(m);
+        std::cout << j.in << " -> " << j.out << " (" << bytes << " bytes)" << std::endl;
+    }
+    void fail(const BatchJob &j, const char *what) {
+        failed++;
+        std::lock_guard<std::mutex> lock(m);
+        std::cerr << j.in << ": " << what << std::endl;
+    }
+};
+
+} // namespace detail
+
+// Encode every job on the pool. Each file is read by one task, which then
+// fans out one task per segment and channel element for the track layer;
+// the last of those stitches the track synthesis and fans out the residual
+// tasks, and the task finishing a file's last residual writes it. Lossless
+// files skip the track layer and fan out one task per segment. Returns the
+// number of failed jobs.
+inline size_t encode_batch(const std::vector<BatchJob> &jobs, const EncodeParams &p,
+                           ThreadPool &pool) {
+    struct File {
+        StreamHeader hdr;
+        Planar x;
+        size_t nsamp = 0; // per channel
+        std::vector<std::pair<size_t, size_t>> ranges;
+        std::vector<SegmentTracks> tracks;
+        Planar synth;
+        std::vector<SegmentInfo> segs;
+        std::vector<std::vector<uint8_t>> payloads;
+        std::atomic<size_t> remaining{0};
+        std::atomic<bool> failed{false};
+    };
+
+    std::vector<detail::BatchScratch> scratch(pool.size());
+    detail::BatchReport report;
+    size_t seg_frames = p.seg_frames ? p.seg_frames : BATCH_SEGMENT_FRAMES;
+
+    auto finish = [&](const BatchJob &job, File &file) {
+        if (file.failed) return;
+        try {
+            BitWriter bw;
+            file.hdr.write(bw);
+            write_segments(bw, file.hdr.flags & STREAM_LOSSLESS ? CODING_LOSSLESS : CODING_HYBRID, file.nsamp,
+                           file.segs, file.payloads);
+            bw.save(job.out);
+            report.ok(job, bw.bytes_written());
+        } catch (const std::exception &e) {
+            report.fail(job, e.what());
+        }
+    };
+
+    auto residuals = [&](const BatchJob &job, std::shared_ptr<File> file) {
+        if (file->failed) return;
+        size_t n = file->ranges.size();
+        file->synth.assign(file->x.size(),
+                           std::vector<float>(extended_length(file->nsamp, file->hdr), 0.0f));
+        for (size_t i = 0; i < n; ++i)
+            stitch_segment(file->synth, segment_span(file->ranges[i].first, file->ranges[i].second,
+                                                     file->hdr.nfft, file->hdr.hop),
+                           file->tracks[i].synth);
+        rotate_planes(file->hdr.channel_elements(), file->synth, 0, file->synth[0].size());
+        file->remaining = n;
+        for (size_t i = 0; i < n; ++i) {
+            pool.submit([&, file, i] {
+                try {
+                    BitWriter &sw = scratch[pool.worker_index()].bw;
+                    file->segs[i] = encode_segment_residual(file->x, file->synth, file->tracks[i],
+                                                            file->hdr, sw, p.rate);
+                    file->payloads[i] = sw.bytes();
+                    file->segs[i].bytes = file->payloads[i].size();
+                } catch (const std::exception &e) {
+                    if (!file->failed.exchange(true)) report.fail(job, e.what());
+                }
+                if (--file->remaining == 0) finish(job, *file);
+            });
+        }
+    };
+
+    for (const auto &job : jobs) {
+        pool.submit([&, seg_frames] {
+            std::shared_ptr<File> file;
+            try {
+                WavMap w(job.in); // converted in place, no raw copy
+                file = std::make_shared<File>();
+                file->hdr.nfft = (uint32_t)p.nfft;
+                file->hdr.hop = (uint32_t)p.hop;
+                file->hdr.sr = (uint32_t)w.sample_rate();
+                file->hdr.ch = (uint32_t)w.channels();
+                file->hdr.channel_mask = w.channel_mask();
+                file->hdr.pcm = w.format();
+                file->hdr.step = p.step;
+                file->hdr.flags = (p.psy ? STREAM_PSY : 0u) | (p.phase.second_order ? STREAM_PHASE2 : 0u) |
+                                  (p.pns ? STREAM_PNS : 0u) | (p.sbr_hz ? STREAM_SBR : 0u);
+                file->hdr.sbr_hz = p.sbr_hz;
+                file->hdr.track_phase_bits = p.phase.track_bits;
+                file->hdr.birth_phase_bits = p.phase.birth_bits;
+                file->x = w.read_planes();
+                if (p.resample_hz && p.resample_hz != w.sample_rate()) {
+                    resample_planes(file->x, w.sample_rate(), p.resample_hz);
+                    file->hdr.sr = (uint32_t)p.resample_hz;
+                }
+                if (p.low_delay) low_delay_profile(file->hdr, p.hop);
+                if (p.lossless) file->hdr.flags = STREAM_LOSSLESS;
+                file->nsamp = file->x[0].size();
+                LevelMeter level;
+                for (const auto &c : file->x) level.add(c.data(), c.size());
+                file->hdr.peak_ref = level.peak;
+                file->hdr.rms_ref = level.rms();
+                file->ranges = p.lossless ? plan_lossless_segments(file->nsamp, file->hdr.hop, seg_frames)
+                                          : plan_segments(num_frames(file->nsamp, file->hdr.hop), seg_frames);
+            } catch (const std::exception &e) {
+                report.fail(job, e.what());
+                return;
+            }
+            size_t n = file->ranges.size();
+            if (p.lossless) {
+                // no track pass: one task per segment, the last one writes the file
+                file->segs.resize(n);
+                file->payloads.resize(n);
+                file->remaining = n;
+                if (n == 0) finish(job, *file);
+                for (size_t i = 0; i < n; ++i) {
+                    pool.submit([&, file, i] {
+                        try {
+                            detail::BatchScratch &s = scratch[pool.worker_index()];
+                            file->segs[i] = encode_lossless_segment(file->x, file->ranges[i].first,
+                                                                    file->ranges[i].second, file->hdr, s.bw,
+                                                                    s.lossless);
+                            file->payloads[i] = s.bw.bytes();
+                            file->segs[i].bytes = file->payloads[i].size();
+                        } catch (const std::exception &e) {
+                            if (!file->failed.exchange(true)) report.fail(job, e.what());
+                        }
+                        if (--file->remaining == 0) finish(job, *file);
+                    });
+                }
+                return;
+            }
+            size_t nelem = file->hdr.channel_elements().size();
+            file->tracks.resize(n);
+            file->segs.resize(n);
+            file->payloads.resize(n);
+            for (size_t i = 0; i < n; ++i)
+                begin_segment_tracks(file->ranges[i].first, file->ranges[i].second, file->hdr,
+                                     file->tracks[i]);
+            file->remaining = n * nelem;
+            for (size_t t = 0; t < n * nelem; ++t) {
+                pool.submit([&, file, t, nelem] {
+                    try {
+                        encode_element_tracks(file->x, t % nelem, file->hdr, p.tracks,
+                                              file->tracks[t / nelem], p.rate);
+                    } catch (const std::exception &e) {
+                        if (!file->failed.exchange(true)) report.fail(job, e.what());
+                    }
+                    if (--file->remaining == 0) residuals(job, file);
+                });
+            }
+        });
+    }
+    pool.wait();
+    return report.failed;
+}
+
+// The decoder's output options, shared by one-file and batch decodes.
+struct DecodeParams {
+    bool base_only = false;  // tracks only, no residual decode
+    int out_rate = 0;        // write at this rate, 0 = the stream's
+    bool pcm_given = false;  // write as pcm rather than the source's format
+    PcmFormat pcm;
+    bool limit = false;      // unit gain through the peak limiter
+    bool loudness = false;   // match the source RMS to target_dbfs instead of its peak
+    float target_dbfs = 0.0f;
+
+    PcmFormat format(const StreamHeader &hdr) const { return pcm_given ? pcm : hdr.pcm; }
+    float gain(const StreamHeader &hdr) const { return limit ? 1.0f : output_gain(hdr, loudness, target_dbfs); }
+};
+
+// Decode every job on the pool, one task per segment; segments are
+// overlap-added into the file's output as they complete, which then goes
+// through the same output stage as a one-file decode with the same p.
+inline size_t decode_batch(const std::vector<BatchJob> &jobs, ThreadPool &pool, const DecodeParams &p = {}) {
+    struct File {
+        StreamHeader hdr;
+        StreamLayout layout;
+        Planar pcm;
+        std::mutex m;
+        std::atomic<size_t> remaining{0};
+        std::atomic<bool> failed{false};
+    };
+
+    std::vector<detail::BatchScratch> scratch(pool.size());
+    detail::BatchReport report;
+
+    auto finish = [&](const BatchJob &job, File &file) {
+        if (file.failed) return;
+        try {
+            for (auto &c : file.pcm) finish_output(c, file.layout.nsamp, file.hdr);
+            const int sr = p.out_rate ? p.out_rate : (int)file.hdr.sr;
+            if (sr != (int)file.hdr.sr) resample_planes(file.pcm, (int)file.hdr.sr, sr);
+            const size_t n = file.pcm[0].size();
+            const PcmFormat format = p.format(file.hdr);
+            WavWriter w(job.out, sr, (int)file.hdr.ch, file.hdr.channel_mask, format);
+            set_output_stage(w, file.hdr, p.gain(file.hdr), sr);
+            w.write(file.pcm, n);
+            w.close();
+            report.ok(job, n * file.hdr.ch * format.bytes());
+        } catch (const std::exception &e) {
+            report.fail(job, e.what());
+        }
+    };
+
+    for (const auto &job : jobs) {
+        pool.submit([&] {
+            std::shared_ptr<File> file;
+            try {
+                BitReader br(job.in);
+                file = std::make_shared<File>();
+                file->hdr = StreamHeader::read(br);
+                if (p.base_only) file->hdr.flags |= STREAM_BASE_ONLY;
+                file->layout = read_segments(br);
+                file->pcm.assign(file->hdr.ch,
+                                 std::vector<float>(extended_length(file->layout.nsamp, file->hdr), 0.0f));
+            } catch (const std::exception &e) {
+                report.fail(job, e.what());
+                return;
+            }
+            size_t n = file->layout.segs.size();
+            file->remaining = n;
+            if (n == 0) finish(job, *file);
+            for (size_t i = 0; i < n; ++i) {
+                pool.submit([&, file, i] {
+                    try {
+                        Planar &out = scratch[pool.worker_index()].pcm;
+                        StreamLayout &L = file->layout;
+                        decode_segment(L.readers[i], L.coding, L.segs[i], file->hdr, out);
+                        std::lock_guard<std::mutex> lock(file->m);
+                        stitch_segment(file->pcm, L.segs[i], out);
+                    } catch (const std::exception &e) {
+                        if (!file->failed.exchange(true)) report.fail(job, e.what());
+                    }
+                    if (--file->remaining == 0) finish(job, *file);
+                });
+            }
+        });
+    }
+    pool.wait();
+    return report.failed;
+}
+
+} // namespace wofl
@@ -1,7 +1,10 @@
 #pragma once
 #include <vector>
 #include <cstdint>
+#include <algorithm>
 #include <fstream>
+#include <iterator>
+#include <memory>
 #include <stdexcept>
 #include <string>
 
@@ -25,20 +28,85 @@ public:
         }
     }
 
-    // write multiple bits from LSB of value
+    // write multiple bits from LSB of value, a byte's worth at a time
     void put_bits(uint32_t value, int nbits) {
-        for (int i = 0; i < nbits; i++) {
-            put_bit((value >> i) & 1);
+        while (nbits > 0) {
+            int n = std::min(nbits, 8 - bitpos);
+            buffer[bytepos] |= uint8_t((value & ((1u << n) - 1u)) << bitpos);
+            value = n < 32 ? value >> n : 0;
+            nbits -= n;
+            bitpos += n;
+            if (bitpos == 8) {
+                buffer.push_back(0);
+                bytepos++;
+                bitpos = 0;
+            }
         }
     }
 
+    // n one bits
+    void put_ones(uint32_t n) {
+        for (; n >= 24; n -= 24) put_bits(0xFFFFFFu, 24);
+        put_bits((1u << n) - 1u, (int)n);
+    }
+
     // convenience for full words
     void write32(uint32_t v) {
         put_bits(v, 32);
     }
 
+    // low word first
+    void write64(uint64_t v) {
+        write32(uint32_t(v));
+        write32(uint32_t(v >> 32));
+    }
+
+    // append all bits written to another writer
+    void append(const BitWriter &other) {
+        for (size_t i = 0; i < other.bytepos; ++i) put_bits(other.buffer[i], 8);
+        put_bits(other.buffer[other.bytepos], other.bitpos);
+    }
+
+    // drop all bits but keep the allocation
+    void clear() {
+        buffer.assign(1, 0);
+        bytepos = 0;
+        bitpos = 0;
+    }
+
     size_t bytes_written() const { return buffer.size(); }
 
+    // exact number of bits written so far
+    size_t bit_count() const { return bytepos * 8 + bitpos; }
+
+    // pad to the next byte boundary (no-op if already aligned)
+    void align_byte() {
+        if (bitpos == 0) return;
+        buffer.push_back(0);
+        bytepos++;
+        bitpos = 0;
+    }
+
+    // append whole bytes; the writer must be byte aligned
+    void append_bytes(const std::vector<uint8_t> &bytes) {
+        if (bitpos != 0) throw std::runtime_error("append_bytes on unaligned writer");
+        buffer.pop_back();
+        buffer.insert(buffer.end(), bytes.begin(), bytes.end());
+        buffer.push_back(0);
+        bytepos = buffer.size() - 1;
+    }
+
+    // overwrite whole bytes already written, starting at byte pos
+    void patch_bytes(size_t pos, const std::vector<uint8_t> &bytes) {
+        if (pos + bytes.size() > bytepos) throw std::runtime_error("patch_bytes past the written bytes");
+        std::copy(bytes.begin(), bytes.end(), buffer.begin() + pos);
+    }
+
+    // payload bytes, without the trailing empty byte
+    std::vector<uint8_t> bytes() const {
+        return std::vector<uint8_t>(buffer.begin(), buffer.begin() + bytepos + (bitpos ? 1 : 0));
+    }
+
     void save(const std::string &filename) {
         std::ofstream f(filename, std::ios::binary);
         if (!f) throw std::runtime_error("Cannot open file for writing");
@@ -47,20 +115,71 @@ public:
 };
 
 class BitReader {
-    std::vector<uint8_t> buffer;
+    std::shared_ptr<const std::vector<uint8_t>> buffer;
     size_t bytepos = 0;
+    size_t endpos = 0;
     int bitpos = 0;
 public:
     BitReader(const std::string &filename) {
         std::ifstream f(filename, std::ios::binary);
         if (!f) throw std::runtime_error("Cannot open file for reading");
-        buffer.assign(std::istreambuf_iterator<char>(f), {});
-        if (buffer.empty()) throw std::runtime_error("Empty bitstream file");
+        auto data = std::make_shared<std::vector<uint8_t>>(std::istreambuf_iterator<char>(f),
+                                                           std::istreambuf_iterator<char>());
+        if (data->empty()) throw std::runtime_error("Empty bitstream file");
+        endpos = data->size();
+        buffer = std::move(data);
+    }
+
+    // reader over bytes held in memory
+    explicit BitReader(std::vector<uint8_t> bytes)
+        : buffer(std::make_shared<const std::vector<uint8_t>>(std::move(bytes))), endpos(buffer->size()) {}
+
+    // reader over bytes [begin, end) of a shared buffer
+    BitReader(std::shared_ptr<const std::vector<uint8_t>> buf, size_t begin, size_t end)
+        : buffer(std::move(buf)), bytepos(begin), endpos(end) {
+        if (endpos > buffer->size() || bytepos > endpos)
+            throw std::runtime_error("Bitstream slice out of range");
+    }
+
+    // skip to the next byte boundary (no-op if already aligned)
+    void align_byte() {
+        if (bitpos) { bitpos = 0; bytepos++; }
+    }
+
+    size_t byte_pos() const { return bytepos; }
+
+    // whole bytes left before the end of this reader
+    size_t bytes_left() const { return endpos - bytepos; }
+
+    // independent reader over nbytes starting at absolute byte offset,
+    // within this reader's range
+    BitReader slice(size_t offset, size_t nbytes) const {
+        if (offset > endpos || nbytes > endpos - offset) throw std::runtime_error("Bitstream slice out of range");
+        return BitReader(buffer, offset, offset + nbytes);
+    }
+
+    // reader over the next nbytes from the next byte boundary; this reader
+    // continues after them
+    BitReader take(size_t nbytes) {
+        align_byte();
+        if (nbytes > endpos - bytepos) throw std::runtime_error("Bitstream slice out of range");
+        BitReader r(buffer, bytepos, bytepos + nbytes);
+        bytepos += nbytes;
+        return r;
+    }
+
+    // copy of the next nbytes from the next byte boundary
+    std::vector<uint8_t> read_bytes(size_t nbytes) {
+        align_byte();
+        if (nbytes > endpos - bytepos) throw std::runtime_error("Read past end of bitstream");
+        std::vector<uint8_t> out(buffer->begin() + bytepos, buffer->begin() + bytepos + nbytes);
+        bytepos += nbytes;
+        return out;
     }
 
     int get_bit() {
-        if (bytepos >= buffer.size()) throw std::runtime_error("Read past end of bitstream");
-        int bit = (buffer[bytepos] >> bitpos) & 1;
+        if (bytepos >= endpos) throw std::runtime_error("Read past end of bitstream");
+        int bit = ((*buffer)[bytepos] >> bitpos) & 1;
         bitpos++;
         if (bitpos == 8) { bitpos = 0; bytepos++; }
         return bit;
@@ -68,13 +187,43 @@ public:
 
     uint32_t get_bits(int nbits) {
         uint32_t v = 0;
-        for (int i = 0; i < nbits; i++) {
-            v |= (get_bit() << i);
+        for (int i = 0; i < nbits;) {
+            if (bytepos >= endpos) throw std::runtime_error("Read past end of bitstream");
+            int n = std::min(nbits - i, 8 - bitpos);
+            v |= uint32_t(((*buffer)[bytepos] >> bitpos) & ((1u << n) - 1u)) << i;
+            i += n;
+            bitpos += n;
+            if (bitpos == 8) { bitpos = 0; bytepos++; }
         }
         return v;
     }
 
+    // number of one bits before the next zero bit, which is consumed
+    uint32_t count_ones() {
+        uint32_t q = 0;
+        for (;;) {
+            if (bytepos >= endpos) throw std::runtime_error("Read past end of bitstream");
+            uint32_t rest = uint32_t((*buffer)[bytepos]) >> bitpos;
+            uint32_t avail = 8u - uint32_t(bitpos);
+            uint32_t ones = 0;
+            while (ones < avail && ((rest >> ones) & 1u)) ++ones;
+            q += ones;
+            if (ones < avail) { // the zero is in this byte
+                bitpos += int(ones) + 1;
+                if (bitpos == 8) { bitpos = 0; bytepos++; }
+                return q;
+            }
+            bitpos = 0;
+            bytepos++;
+        }
+    }
+
     uint32_t read32() { return get_bits(32); }
+
+    uint64_t read64() {
+        uint64_t lo = read32();
+        return lo | uint64_t(read32()) << 32;
+    }
 };
 
 } // namespace wofl
@@ -1,32 +1,1093 @@
 #pragma once
 #include <vector>
 #include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <utility>
+#include <memory>
+#include <functional>
+#include <limits>
 #include "bitio.hpp"
+#include "fft.hpp"
+#include "mdct.hpp"
+#include "analysis.hpp"
+#include "parametric.hpp"
+#include "residual.hpp"
+#include "ratectl.hpp"
+#include "channels.hpp"
+#include "pns.hpp"
+#include "sbr.hpp"
+#include "lossless.hpp"
+#include "psy.hpp"
+#include "threadpool.hpp"
+#include "wav.hpp"
 
 namespace wofl {
 
-// stub encoder/decoder for now — just passes samples through
-inline void encode_stream(const std::vector<float> &pcm, int sr, int ch,
-                          size_t nfft, size_t hop, int K,
-                          BitWriter &bw) {
-    // For now: quantize trivially and dump
-    bw.write32((uint32_t)pcm.size());
-    for (float s : pcm) {
-        int16_t q = (int16_t)(s * 32767.0f);
-        bw.write32((uint16_t)q); // store as 16-bit padded into 32
+// Stream layout after the fixed header:
+//   coding, samples per channel, segment count, per-segment {first, count,
+//   bytes, base (CODING_HYBRID only)}, byte alignment, then the segment
+//   payloads back to back.
+// Every segment starts from reset coder state, so segments decode
+// independently and their outputs are overlap-added at `first`. A hybrid
+// payload is two byte-aligned layers: the base layer (every frame's tracks)
+// in its first `base` bytes, then the enhancement layer (every frame's
+// residual), so the residual can be cut off without touching the tracks.
+// Positions and sizes are 64-bit, so a stream is not capped at 2^32
+// samples (about 24.8 h at 48 kHz) or a 4 GiB segment.
+struct SegmentInfo {
+    uint64_t first = 0;   // first output sample the segment contributes to
+    uint64_t count = 0;   // number of output samples it contributes
+    uint64_t bytes = 0;   // payload size in bytes
+    uint64_t base = 0;    // bytes of it in the base layer (CODING_HYBRID)
+};
+
+// header flags
+enum : uint32_t {
+    STREAM_PSY = 1,        // residual bands carry masking-model scalefactors
+    STREAM_PHASE2 = 2,     // second-order track phase prediction
+    STREAM_PNS = 4,        // residual bands may be sent as noise energies
+    STREAM_SBR = 8,        // band above sbr_hz is rebuilt from an envelope
+    STREAM_LOSSLESS = 16,  // exact integer PCM, written back unscaled
+    STREAM_BASE_ONLY = 32, // tracks only: enhancement layer stripped or skipped
+    STREAM_LOW_DELAY = 64, // coded frame by frame, written back at unit gain
+};
+
+// channel indices are sent in 8 bits
+constexpr uint32_t MAX_CHANNELS = 255;
+
+// how segment payloads are coded
+enum : uint32_t {
+    CODING_LOSSLESS = 3,   // LPC + partitioned Rice blocks of integer PCM
+    CODING_HYBRID = 4,     // sinusoidal track layer + MDCT residual layer
+};
+
+// Stream header: frame geometry, format, residual step and the channel
+// map (speaker mask plus the channel elements the encoder coded).
+struct StreamHeader {
+    uint32_t nfft = 2048;
+    uint32_t hop = 512;
+    uint32_t sr = 44100;
+    uint32_t ch = 1;
+    float step = 0.004f;  // residual quantizer step (finest step with STREAM_PSY)
+    uint32_t flags = STREAM_PSY | STREAM_PHASE2 | STREAM_PNS;
+    uint32_t track_phase_bits = 5; // phase resolution of continuing tracks
+    uint32_t birth_phase_bits = 6; // and of new tracks
+    uint32_t sbr_hz = 0;           // bandwidth extension crossover (STREAM_SBR)
+    uint32_t channel_mask = 0; // WAVE_FORMAT_EXTENSIBLE speaker bits, 0 = unspecified
+    PcmFormat pcm;             // sample format of the source, and of the decoded WAV
+    float peak_ref = 0.0f;     // source peak |x| and RMS over all channels,
+    float rms_ref = 0.0f;      // 0 = silent or not measured
+    std::vector<ChannelElement> elements; // empty = plan_elements(ch, channel_mask)
+
+    PhaseQ phase_quant() const {
+        return PhaseQ{track_phase_bits, birth_phase_bits, (flags & STREAM_PHASE2) != 0};
     }
+
+    bool sbr() const { return flags & STREAM_SBR; }
+
+    // bins of an nfft-point STFT the track layer may use
+    size_t track_bins() const { return sbr() ? sbr_bin(sbr_hz, nfft / 2, (int)sr) : nfft / 2 + 1; }
+
+    std::vector<ChannelElement> channel_elements() const {
+        return elements.empty() ? plan_elements(ch, channel_mask) : elements;
+    }
+
+    void write(BitWriter &bw) const {
+        if (ch == 0 || ch > MAX_CHANNELS) throw std::runtime_error("unsupported channel count");
+        for (uint32_t b : {track_phase_bits, birth_phase_bits})
+            if (b < PHASE_BITS_MIN || b > PHASE_BITS_MAX) throw std::runtime_error("unsupported phase resolution");
+        if (sbr() && (sbr_hz < SBR_MIN_HZ || 2 * sbr_hz >= sr || sbr_hz > 0xFFFF))
+            throw std::runtime_error("unsupported bandwidth extension crossover");
+        bw.write32(nfft);
+        bw.write32(hop);
+        bw.write32(sr);
+        bw.write32(ch);
+        uint32_t u;
+        std::memcpy(&u, &step, 4);
+        bw.write32(u);
+        bw.write32(flags);
+        bw.put_bits(track_phase_bits, 4);
+        bw.put_bits(birth_phase_bits, 4);
+        if (sbr()) bw.put_bits(sbr_hz, 16);
+        if (!pcm.valid()) throw std::runtime_error("unsupported sample format");
+        bw.put_bits(pcm.bits, 7);
+        bw.put_bit(pcm.is_float);
+        for (float v : {peak_ref, rms_ref}) {
+            std::memcpy(&u, &v, 4);
+            bw.write32(u);
+        }
+        bw.write32(channel_mask);
+        auto el = channel_elements();
+        bw.put_bits((uint32_t)el.size(), 8);
+        for (const auto &e : el) {
+            bw.put_bits(e.a, 8);
+            bw.put_bits(e.b, 8);
+        }
+    }
+
+    static StreamHeader read(BitReader &br) {
+        StreamHeader h;
+        h.nfft = br.read32();
+        h.hop = br.read32();
+        h.sr = br.read32();
+        h.ch = br.read32();
+        uint32_t u = br.read32();
+        std::memcpy(&h.step, &u, 4);
+        if (h.nfft < 4 || (h.nfft & (h.nfft - 1)) || h.hop < 2 || (h.hop & (h.hop - 1)) || h.hop > h.nfft)
+            throw std::runtime_error("bad stream header (nfft/hop)");
+        if (h.ch == 0 || h.ch > MAX_CHANNELS) throw std::runtime_error("bad stream header (channels)");
+        h.flags = br.read32();
+        h.track_phase_bits = br.get_bits(4);
+        h.birth_phase_bits = br.get_bits(4);
+        for (uint32_t b : {h.track_phase_bits, h.birth_phase_bits})
+            if (b < PHASE_BITS_MIN || b > PHASE_BITS_MAX) throw std::runtime_error("bad stream header (phase bits)");
+        if (h.sbr()) {
+            h.sbr_hz = br.get_bits(16);
+            if (h.sbr_hz < SBR_MIN_HZ || 2 * h.sbr_hz >= h.sr) throw std::runtime_error("bad stream header (crossover)");
+        }
+        h.pcm.bits = (uint16_t)br.get_bits(7);
+        h.pcm.is_float = br.get_bit();
+        if (!h.pcm.valid()) throw std::runtime_error("bad stream header (sample format)");
+        for (float *v : {&h.peak_ref, &h.rms_ref}) {
+            u = br.read32();
+            std::memcpy(v, &u, 4);
+            if (!(*v >= 0.0f && *v < 1e30f)) throw std::runtime_error("bad stream header (reference level)");
+        }
+        h.channel_mask = br.read32();
+        h.elements.resize(br.get_bits(8));
+        for (auto &e : h.elements) {
+            e.a = br.get_bits(8);
+            e.b = br.get_bits(8);
+        }
+        if (!valid_elements(h.elements, h.ch)) throw std::runtime_error("bad stream header (channel map)");
+        return h;
+    }
+};
+
+// Hybrid frame timeline. Frame f analyses x[f*hop, f*hop+nfft) for tracks
+// and codes the residual MDCT block x[(f-1)*hop, (f+1)*hop) (MDCT size =
+// hop). Once tracks up to frame f are synthesized, that residual block is
+// final, so the encoder can subtract the decoded tracks (analysis by
+// synthesis). Because blocks start one hop before sample 0, segment output
+// positions are on an "extended" timeline shifted by one hop.
+inline size_t num_frames(size_t nsamp, size_t hop) {
+    return (nsamp + hop - 1) / hop + 1;
+}
+
+// frame ranges [f0, f1) of the segments; seg_frames = 0 gives one segment
+inline std::vector<std::pair<size_t, size_t>> plan_segments(size_t nframes, size_t seg_frames) {
+    if (seg_frames == 0) seg_frames = std::max<size_t>(nframes, 1);
+    std::vector<std::pair<size_t, size_t>> ranges;
+    for (size_t f0 = 0; f0 < nframes; f0 += seg_frames)
+        ranges.emplace_back(f0, std::min(nframes, f0 + seg_frames));
+    return ranges;
+}
+
+// extended-timeline placement of frames [f0, f1)
+inline SegmentInfo segment_span(size_t f0, size_t f1, size_t nfft, size_t hop) {
+    return SegmentInfo{uint64_t(f0 * hop), uint64_t((f1 - f0) * hop + nfft), 0};
+}
+
+// length of the extended-timeline buffer the segments are stitched into
+inline size_t extended_length(size_t nsamp, const StreamHeader &hdr) {
+    return num_frames(nsamp, hdr.hop) * hdr.hop + hdr.nfft;
+}
+
+// overlap-add one segment-local buffer into the output at its position
+inline void stitch_segment(std::vector<float> &pcm, const SegmentInfo &seg,
+                           const std::vector<float> &out) {
+    size_t first = seg.first;
+    size_t n = std::min(out.size(), pcm.size() > first ? pcm.size() - first : 0);
+    for (size_t k = 0; k < n; ++k) pcm[first + k] += out[k];
+}
+
+inline void stitch_segment(Planar &pcm, const SegmentInfo &seg, const Planar &out) {
+    for (size_t c = 0; c < std::min(pcm.size(), out.size()); ++c) stitch_segment(pcm[c], seg, out[c]);
+}
+
+// ---- encoder ----
+
+// Encoder state of one segment between the passes: per-element, per-frame
+// track bits; the decoded track synthesis per channel on the extended
+// timeline starting at f0*hop, in the coded domain (mid/side for pairs;
+// rotate_planes brings it back to L/R); and, once analysed, the residual
+// MDCT spectra per channel and frame.
+struct SegmentTracks {
+    size_t f0 = 0, f1 = 0;
+    std::vector<std::vector<BitWriter>> frames; // [element][frame]
+    Planar synth;
+    std::vector<Planar> residual;               // [channel][frame]
+    std::vector<std::vector<std::vector<int>>> scale; // [channel][frame] band scalefactors
+    std::vector<Planar> envelope;               // [channel][frame] STREAM_SBR levels
+};
+
+// Per-thread residual front end: the MDCT, for STREAM_PSY streams the
+// masking model over the residual's MDCT bins, and for STREAM_SBR streams
+// the high-band envelope. Both look at the input block rather than the
+// residual: the input is what masks the noise, and what the decoder's
+// high band has to match.
+struct ResidualAnalysis {
+    MDCT mdct;
+    bool psy;
+    float base;
+    PsyModel model;
+    SbrBands sbr;
+    std::vector<float> X, power, spw, thr, e;
+    std::vector<cpx> S;
+    std::vector<double> prefix;
+    std::vector<uint8_t> held;
+    std::vector<PartialTracker> partials; // per channel
+
+    explicit ResidualAnalysis(const StreamHeader &hdr)
+        : mdct(hdr.hop), psy(hdr.flags & STREAM_PSY), base(hdr.step) {
+        // an orthonormal MDCT of a full-scale sine holds hop/2 of power
+        if (psy) model = PsyModel((int)hdr.hop, (int)hdr.sr, 0.5f * float(hdr.hop));
+        if (hdr.sbr()) sbr = SbrBands(hdr.hop, (int)hdr.sr, hdr.sbr_hz);
+    }
+
+    // band scalefactors (none without STREAM_PSY) and high-band envelope
+    // (none without STREAM_SBR) of channel c's 2*hop input block; a
+    // channel's blocks come in frame order
+    void input_bands(const std::vector<float> &block, size_t c, std::vector<int> &sf, std::vector<float> &env) {
+        sf.clear();
+        env.clear();
+        if (!psy && !sbr.cross) return;
+        mdct.forward(block, 0, X);
+        if (sbr.cross) sbr_envelope(X, sbr, power, prefix, e, env);
+        if (!psy) return;
+        power_of(X, power);
+        // tonality from a Hann STFT of the same block, on the MDCT's bins;
+        // only partials held from frame to frame count
+        stft_frame(block, 0, block.size(), S);
+        spw.resize(power.size());
+        for (size_t k = 0; k < spw.size(); ++k) spw[k] = std::norm(S[k]);
+        if (partials.size() <= c) partials.resize(c + 1);
+        partials[c].update(spw, held);
+        model.thresholds(power, spw, held, thr, true);
+        scalefactors(thr, model.bands, base, sf);
+    }
+
+    // clear the residual bins the decoder rebuilds from the envelope
+    void band_limit(std::vector<float> &C) const {
+        if (sbr.cross) std::fill(C.begin() + sbr.cross, C.end(), 0.0f);
+    }
+};
+
+// A band coded as M/S mixes both channels' noise, so a masking band that
+// overlaps any coupled band takes the finer of the two channels' steps.
+inline void couple_scalefactors(std::vector<int> &a, std::vector<int> &b, const std::vector<int> &pbands,
+                                const std::vector<size_t> &cbands, const std::vector<uint8_t> &mask) {
+    size_t j = 0;
+    for (size_t i = 0; i + 1 < pbands.size(); ++i) {
+        while (j + 1 < cbands.size() && cbands[j + 1] <= size_t(pbands[i])) ++j;
+        bool ms = false;
+        for (size_t k = j; k + 1 < cbands.size() && cbands[k] < size_t(pbands[i + 1]); ++k) ms |= mask[k] != 0;
+        if (ms) a[i] = b[i] = std::min(a[i], b[i]);
+    }
+}
+
+// Side tracks weaker than this fraction of the strongest mid track are
+// dropped (about -30 dB): partials present in both channels are carried by
+// the mid tracks alone.
+constexpr float SIDE_TRACK_FLOOR = 0.03f;
+
+// Track selection for the coded channels of one element; budget is the
+// track budget of each channel.
+inline void pick_tracks(const ChannelElement &e, const Planar &pw, const std::vector<std::vector<cpx>> &X,
+                        PeakPicker &picker,
+                        const std::vector<ParametricState> &st, MagQ &mq, double budget,
+                        std::vector<std::vector<Peak>> &peaks) {
+    select_tracks(pw[e.a], X[e.a], picker, st[e.a], mq, budget, peaks[e.a]);
+    if (!e.pair()) return;
+    float top = 0.0f;
+    for (const auto &p : peaks[e.a]) top = std::max(top, p.mag);
+    std::vector<Peak> &side = peaks[e.b];
+    select_tracks(pw[e.b], X[e.b], picker, st[e.b], mq, budget, side);
+    side.erase(std::remove_if(side.begin(), side.end(),
+                              [&](const Peak &p) { return p.mag < SIDE_TRACK_FLOOR * top; }),
+               side.end());
+}
+
+// code the tracks of one element and synthesize them into synth at pos
+inline void code_tracks(BitWriter &bw, const ChannelElement &e, const std::vector<std::vector<Peak>> &peaks,
+                        std::vector<ParametricState> &st, MagQ &mq, size_t nfft, size_t hop,
+                        std::vector<cpx> &Xs, std::vector<Peak> &recon, Planar &synth, size_t pos) {
+    for (uint32_t c : {e.a, e.b}) {
+        encode_tracks(bw, peaks[c], st[c], mq, recon);
+        synth_frame(recon, nfft, hop, Xs, synth[c], pos);
+        if (!e.pair()) break;
+    }
+}
+
+// Residual layer of one frame; C holds each channel's MDCT block, sf its
+// band scalefactors over pbands (empty without STREAM_PSY), env its
+// high-band envelope (empty without STREAM_SBR), and track_bits is what the
+// frame's tracks took in the base layer. The envelopes go first. Pairs pick L/R
+// or M/S per coupling band (rotating C in place) and send the band mask;
+// then come the noise-substituted bands (STREAM_PNS), judged against the
+// previous frame's step index, the step index and each channel's
+// coefficients and scalefactors.
+inline void code_residual_frame(BitWriter &bw, const std::vector<ChannelElement> &el, Planar &C,
+                                std::vector<std::vector<int>> &sf, const Planar &env,
+                                const std::vector<int> &pbands, const std::vector<size_t> &cbands,
+                                ResidualCoder &coder, NoiseCoder &pns, SbrEnvelopes &envc,
+                                size_t track_bits, std::vector<uint8_t> &mask) {
+    const size_t start = bw.bit_count();
+    for (size_t c = 0; c < env.size(); ++c) envc.write(bw, c, env[c]);
+    for (const auto &e : el) {
+        if (!e.pair()) continue;
+        choose_ms(C[e.a], C[e.b], cbands, mask);
+        write_ms_mask(bw, mask);
+        if (!sf.empty()) couple_scalefactors(sf[e.a], sf[e.b], pbands, cbands, mask);
+    }
+    pns.code(bw, C, pbands, [&](size_t c, size_t b) {
+        return step_for_index(coder.base, coder.prev_s + (sf.empty() ? 0 : sf[c][b]));
+    });
+    coder.code(bw, C, sf, pbands, track_bits + bw.bit_count() - start);
+}
+
+// size the per-segment buffers before the per-element track passes
+inline void begin_segment_tracks(size_t f0, size_t f1, const StreamHeader &hdr, SegmentTracks &out) {
+    out.f0 = f0;
+    out.f1 = f1;
+    out.frames.resize(hdr.channel_elements().size());
+    for (auto &fr : out.frames) fr.resize(f1 - f0);
+    out.synth.assign(hdr.ch, std::vector<float>(segment_span(f0, f1, hdr.nfft, hdr.hop).count, 0.0f));
+    out.residual.clear();
+}
+
+// Parametric layer of element ei for the segment's frames. Elements share
+// nothing, so they can run concurrently. With rate control on, each frame
+// keeps only as many of its best peaks as fit the channel's share of the
+// track budget.
+inline void encode_element_tracks(const Planar &x, size_t ei, const StreamHeader &hdr, const TrackSelect &sel,
+                                  SegmentTracks &out, const RateParams &rate = {}) {
+    const size_t nfft = hdr.nfft, hop = hdr.hop, ch = hdr.ch;
+    const ChannelElement e = hdr.channel_elements()[ei];
+    const double budget = RateControl(rate, hop, hdr.sr).track_budget() / double(ch);
+
+    std::vector<ParametricState> st(ch, ParametricState(nfft, hop, hdr.phase_quant()));
+    MagQ mq;
+    PeakPicker picker(sel, nfft, (int)hdr.sr, hdr.track_bins());
+    std::vector<std::vector<cpx>> X(ch);
+    std::vector<cpx> Xs;
+    Planar pw(ch);
+    std::vector<std::vector<Peak>> peaks(ch);
+    std::vector<Peak> recon;
+    for (size_t f = out.f0; f < out.f1; ++f) {
+        for (uint32_t c : {e.a, e.b}) {
+            stft_frame(x[c], f * hop, nfft, X[c]);
+            if (!e.pair()) break;
+        }
+        couple_spectra(e, X);
+        for (uint32_t c : {e.a, e.b}) {
+            power_spectrum(X[c], pw[c]);
+            if (!e.pair()) break;
+        }
+        pick_tracks(e, pw, X, picker, st, mq, budget, peaks);
+        BitWriter &fb = out.frames[ei][f - out.f0];
+        fb.clear();
+        code_tracks(fb, e, peaks, st, mq, nfft, hop, Xs, recon, out.synth, (f - out.f0) * hop + hop);
+    }
+}
+
+inline void encode_segment_tracks(const Planar &x, size_t f0, size_t f1,
+                                  const StreamHeader &hdr, const TrackSelect &sel, SegmentTracks &out,
+                                  const RateParams &rate = {}) {
+    begin_segment_tracks(f0, f1, hdr, out);
+    for (size_t ei = 0; ei < out.frames.size(); ++ei) encode_element_tracks(x, ei, hdr, sel, out, rate);
+}
+
+// MDCT spectra of channel c's residual blocks x[(f-1)*hop, (f+1)*hop) -
+// synth (extended index f*hop) for the segment's frames, and the band
+// scalefactors of the input blocks. synth is the complete track synthesis
+// on the extended timeline (all segments overlap-added, back in the channel
+// domain), so blocks at segment borders see their neighbours' tracks
+// exactly as the decoder will.
+inline void analyse_segment_residual(const Planar &x, const Planar &synth, size_t c,
+                                     const StreamHeader &hdr, SegmentTracks &tracks) {
+    const size_t hop = hdr.hop, frames = tracks.f1 - tracks.f0;
+    ResidualAnalysis ra(hdr);
+    std::vector<float> xin(2 * hop), r(2 * hop);
+    Planar &C = tracks.residual[c];
+    C.resize(frames);
+    tracks.scale[c].resize(frames);
+    tracks.envelope[c].resize(frames);
+    for (size_t f = tracks.f0; f < tracks.f1; ++f) {
+        for (size_t n = 0; n < 2 * hop; ++n) {
+            size_t t = f * hop + n; // extended index; real sample t - hop
+            xin[n] = (t >= hop && t - hop < x[c].size()) ? x[c][t - hop] : 0.0f;
+            r[n] = xin[n] - (t < synth[c].size() ? synth[c][t] : 0.0f);
+        }
+        ra.mdct.forward(r, 0, C[f - tracks.f0]);
+        ra.band_limit(C[f - tracks.f0]);
+        ra.input_bands(xin, c, tracks.scale[c][f - tracks.f0], tracks.envelope[c][f - tracks.f0]);
+    }
+}
+
+// Payload of one segment into sw: the track bits of every frame as the
+// base layer, then the residual as the enhancement layer. Spectra are
+// analysed here unless that already ran per channel, and are consumed by
+// the coding. The bit reservoir starts empty in every segment, so segments
+// stay independent.
+inline SegmentInfo encode_segment_residual(const Planar &x, const Planar &synth,
+                                           SegmentTracks &tracks, const StreamHeader &hdr,
+                                           BitWriter &sw, const RateParams &rate = {}) {
+    const size_t hop = hdr.hop, ch = hdr.ch;
+    const auto el = hdr.channel_elements();
+    if (tracks.residual.size() != ch) {
+        tracks.residual.resize(ch);
+        tracks.scale.resize(ch);
+        tracks.envelope.resize(ch);
+        for (size_t c = 0; c < ch; ++c) analyse_segment_residual(x, synth, c, hdr, tracks);
+    }
+    const auto cbands = coupling_bands(hop);
+    std::vector<int> pbands;
+    bark_band_edges(2 * (int)hop, (int)hdr.sr, pbands);
+    const bool psy = hdr.flags & STREAM_PSY;
+    ResidualCoder coder(hdr.step, RateControl(rate, hop, hdr.sr));
+    NoiseCoder pns(hdr.flags & STREAM_PNS, pbands, hop, (int)hdr.sr, ch);
+    SbrEnvelopes envc;
+    if (hdr.sbr()) envc = SbrEnvelopes(ch, SbrBands(hop, (int)hdr.sr, hdr.sbr_hz).size());
+    Planar C(ch);
+    std::vector<std::vector<int>> sf(psy ? ch : 0);
+    Planar env(hdr.sbr() ? ch : 0);
+    std::vector<uint8_t> mask;
+    const size_t frames = tracks.f1 - tracks.f0;
+    sw.clear();
+    for (size_t j = 0; j < frames; ++j)
+        for (const auto &fe : tracks.frames) sw.append(fe[j]);
+    sw.align_byte();
+    SegmentInfo seg = segment_span(tracks.f0, tracks.f1, hdr.nfft, hop);
+    seg.base = sw.bit_count() / 8;
+    for (size_t j = 0; j < frames; ++j) {
+        size_t track_bits = 0;
+        for (const auto &fe : tracks.frames) track_bits += fe[j].bit_count();
+        for (size_t c = 0; c < ch; ++c) C[c].swap(tracks.residual[c][j]);
+        for (size_t c = 0; c < sf.size(); ++c) sf[c].swap(tracks.scale[c][j]);
+        for (size_t c = 0; c < env.size(); ++c) env[c].swap(tracks.envelope[c][j]);
+        code_residual_frame(sw, el, C, sf, env, pbands, cbands, coder, pns, envc, track_bits, mask);
+    }
+    return seg;
+}
+
+// Hybrid coding one frame at a time, for input that arrives as it is
+// captured: the per-frame work of encode_stream within one segment, with
+// the track synthesis and one hop of input history carried from frame to
+// frame. Frame f's block is x[f*hop, f*hop+nfft) of every channel; its
+// tracks go to one writer and its residual to another, as in the two
+// layers of a segment.
+struct FrameEncoder {
+    StreamHeader hdr;
+    std::vector<ChannelElement> el;
+    std::vector<ParametricState> st;
+    MagQ mq;
+    PeakPicker picker;
+    ResidualAnalysis ra;
+    RateControl rc;
+    ResidualCoder coder;
+    double track_budget;
+    std::vector<size_t> cbands;
+    std::vector<int> pbands;
+    NoiseCoder pns;
+    SbrEnvelopes envc;
+    Planar acc;   // track synthesis (coded domain), extended [f*hop, f*hop+hop+nfft)
+    Planar xprev; // input [(f-1)*hop, f*hop)
+    Planar syn, r, C, pw;
+    std::vector<std::vector<cpx>> X;
+    std::vector<std::vector<Peak>> peaks;
+    std::vector<float> xin;
+    std::vector<std::vector<int>> sf;
+    Planar env;
+    std::vector<int> no_sf; // side info the stream does not carry
+    std::vector<float> no_env;
+    std::vector<uint8_t> mask;
+    std::vector<cpx> Xs;
+    std::vector<Peak> recon;
+
+    FrameEncoder(const StreamHeader &h, const TrackSelect &sel, const RateParams &rate = {})
+        : hdr(h), el(h.channel_elements()), st(h.ch, ParametricState(h.nfft, h.hop, h.phase_quant())),
+          picker(sel, h.nfft, (int)h.sr, h.track_bins()), ra(h), rc(rate, h.hop, h.sr), coder(h.step, rc),
+          track_budget(rc.track_budget() / double(h.ch)), cbands(coupling_bands(h.hop)),
+          pbands([&] {
+              std::vector<int> b;
+              bark_band_edges(2 * (int)h.hop, (int)h.sr, b);
+              return b;
+          }()),
+          pns(h.flags & STREAM_PNS, pbands, h.hop, (int)h.sr, h.ch),
+          acc(h.ch, std::vector<float>(h.hop + h.nfft, 0.0f)), xprev(h.ch, std::vector<float>(h.hop, 0.0f)),
+          syn(h.ch, std::vector<float>(2 * h.hop)), r(h.ch, std::vector<float>(2 * h.hop)), C(h.ch), pw(h.ch),
+          X(h.ch), peaks(h.ch), xin(2 * h.hop), sf(ra.psy ? h.ch : 0), env(h.sbr() ? h.ch : 0) {
+        if (h.sbr()) envc = SbrEnvelopes(h.ch, ra.sbr.size());
+    }
+
+    // STFT, coupling and power spectra of a frame block, and with rate
+    // control off the track selection, which then needs no coder state
+    void analyse(const Planar &block, std::vector<std::vector<cpx>> &Xb, Planar &pwb,
+                 std::vector<std::vector<Peak>> &pk) {
+        for (size_t c = 0; c < hdr.ch; ++c) stft_frame(block[c], 0, hdr.nfft, Xb[c]);
+        for (const auto &e : el) couple_spectra(e, Xb);
+        for (size_t c = 0; c < hdr.ch; ++c) power_spectrum(Xb[c], pwb[c]);
+        if (!rc.active())
+            for (const auto &e : el)
+                pick_tracks(e, pwb, Xb, picker, st, mq, std::numeric_limits<double>::infinity(), pk);
+    }
+
+    // code a frame analysed by analyse(); peaks are picked here instead
+    // when rate control is on, as trimming to the budget needs the track
+    // state
+    void code(const Planar &block, const std::vector<std::vector<cpx>> &Xb, const Planar &pwb,
+              std::vector<std::vector<Peak>> &pk, BitWriter &tracks, BitWriter &residual) {
+        const size_t hop = hdr.hop;
+        if (rc.active())
+            for (const auto &e : el) pick_tracks(e, pwb, Xb, picker, st, mq, track_budget, pk);
+        tracks.clear();
+        for (const auto &e : el) code_tracks(tracks, e, pk, st, mq, hdr.nfft, hop, Xs, recon, acc, hop);
+        for (size_t c = 0; c < hdr.ch; ++c) std::copy(acc[c].begin(), acc[c].begin() + 2 * hop, syn[c].begin());
+        rotate_planes(el, syn, 0, 2 * hop);
+        for (size_t c = 0; c < hdr.ch; ++c) {
+            std::copy(xprev[c].begin(), xprev[c].end(), xin.begin());
+            std::copy(block[c].begin(), block[c].begin() + hop, xin.begin() + hop);
+            for (size_t n = 0; n < 2 * hop; ++n) r[c][n] = xin[n] - syn[c][n];
+            ra.mdct.forward(r[c], 0, C[c]);
+            ra.band_limit(C[c]);
+            ra.input_bands(xin, c, ra.psy ? sf[c] : no_sf, hdr.sbr() ? env[c] : no_env);
+            std::copy(block[c].begin(), block[c].begin() + hop, xprev[c].begin());
+            std::copy(acc[c].begin() + hop, acc[c].end(), acc[c].begin());
+            std::fill(acc[c].end() - hop, acc[c].end(), 0.0f);
+        }
+        residual.clear();
+        code_residual_frame(residual, el, C, sf, env, pbands, cbands, coder, pns, envc, tracks.bit_count(), mask);
+    }
+
+    void encode(const Planar &block, BitWriter &tracks, BitWriter &residual) {
+        analyse(block, X, pw, peaks);
+        code(block, X, pw, peaks, tracks, residual);
+    }
+};
+
+// write the segment table and byte-aligned payloads
+inline void write_segments(BitWriter &bw, uint32_t coding, size_t nsamp,
+                           const std::vector<SegmentInfo> &segs,
+                           const std::vector<std::vector<uint8_t>> &payloads) {
+    bw.write32(coding);
+    bw.write64(nsamp);
+    bw.write32((uint32_t)segs.size());
+    for (const auto &s : segs) {
+        bw.write64(s.first);
+        bw.write64(s.count);
+        bw.write64(s.bytes);
+        if (coding == CODING_HYBRID) bw.write64(s.base);
+    }
+    bw.align_byte();
+    for (const auto &p : payloads) bw.append_bytes(p);
+}
+
+// frames [0, frames) of a stream coded frame by frame, as one segment from
+// its two layers; base is consumed
+inline void write_single_segment(BitWriter &bw, size_t nsamp, size_t frames, const StreamHeader &hdr,
+                                 BitWriter &base, const BitWriter &enh) {
+    base.align_byte();
+    std::vector<SegmentInfo> segs{segment_span(0, frames, hdr.nfft, hdr.hop)};
+    segs[0].base = base.bit_count() / 8;
+    base.append(enh);
+    std::vector<std::vector<uint8_t>> payloads{base.bytes()};
+    segs[0].bytes = payloads[0].size();
+    write_segments(bw, CODING_HYBRID, nsamp, segs, payloads);
+}
+
+// x holds one plane per channel; seg_frames: segment length in hops, 0 =
+// single segment. threads > 1 runs the per-element track passes
+// and the per-channel residual analysis of every segment on a pool, then
+// codes the segments concurrently. The header must already be written to bw.
+inline void encode_stream(const Planar &x, const StreamHeader &hdr, const TrackSelect &sel,
+                          BitWriter &bw, size_t seg_frames = 0, const RateParams &rate = {},
+                          unsigned threads = 1) {
+    const size_t nsamp = x[0].size(), ch = x.size();
+    const size_t nelem = hdr.channel_elements().size();
+    auto ranges = plan_segments(num_frames(nsamp, hdr.hop), seg_frames);
+    const size_t nseg = ranges.size();
+
+    std::unique_ptr<ThreadPool> pool;
+    if (threads > 1) pool.reset(new ThreadPool(threads));
+    auto run = [&](size_t n, const std::function<void(size_t)> &fn) {
+        if (pool) parallel_for(*pool, n, fn);
+        else for (size_t i = 0; i < n; ++i) fn(i);
+    };
+
+    // pass 1: parametric layer of every segment and element, stitched into
+    // one synthesis
+    std::vector<SegmentTracks> tracks(nseg);
+    for (size_t i = 0; i < nseg; ++i) begin_segment_tracks(ranges[i].first, ranges[i].second, hdr, tracks[i]);
+    run(nseg * nelem, [&](size_t t) {
+        encode_element_tracks(x, t % nelem, hdr, sel, tracks[t / nelem], rate);
+    });
+    Planar synth(ch, std::vector<float>(extended_length(nsamp, hdr), 0.0f));
+    for (size_t i = 0; i < nseg; ++i)
+        stitch_segment(synth, segment_span(ranges[i].first, ranges[i].second, hdr.nfft, hdr.hop),
+                       tracks[i].synth);
+    rotate_planes(hdr.channel_elements(), synth, 0, synth[0].size());
+
+    // pass 2: residual spectra per segment and channel, then the coding
+    // (rate control is sequential within a segment)
+    for (auto &t : tracks) {
+        t.residual.resize(ch);
+        t.scale.resize(ch);
+        t.envelope.resize(ch);
+    }
+    run(nseg * ch, [&](size_t t) {
+        analyse_segment_residual(x, synth, t % ch, hdr, tracks[t / ch]);
+    });
+    std::vector<SegmentInfo> segs(nseg);
+    std::vector<std::vector<uint8_t>> payloads(nseg);
+    run(nseg, [&](size_t i) {
+        BitWriter sw;
+        segs[i] = encode_segment_residual(x, synth, tracks[i], hdr, sw, rate);
+        payloads[i] = sw.bytes();
+        segs[i].bytes = payloads[i].size();
+    });
+
+    write_segments(bw, CODING_HYBRID, nsamp, segs, payloads);
     // user must call bw.save(filename) outside
 }
 
-inline void decode_stream(std::vector<float> &pcm, int sr, int ch,
-                          size_t nfft, size_t hop,
-                          BitReader &br) {
-    size_t nsamp = br.read32();
-    pcm.resize(nsamp);
-    for (size_t i = 0; i < nsamp; i++) {
-        uint16_t q = (uint16_t)br.read32();
-        pcm[i] = (int16_t)q / 32768.0f;
+// ---- lossless encoder ----
+
+// Lossless segments are plain sample ranges of seg_frames hops each (0 =
+// one segment), placed on the extended timeline like hybrid ones but
+// without overlap.
+inline std::vector<std::pair<size_t, size_t>> plan_lossless_segments(size_t nsamp, size_t hop, size_t seg_frames) {
+    auto ranges = plan_segments((nsamp + hop - 1) / hop, seg_frames);
+    for (auto &r : ranges) {
+        r.first *= hop;
+        r.second = std::min(nsamp, r.second * hop);
+    }
+    return ranges;
+}
+
+// Integer sample scale of a lossless stream: x holds hdr.pcm samples scaled
+// to [-1, 1), exact in float up to 24 bits.
+inline float lossless_scale(const StreamHeader &hdr) {
+    if (hdr.pcm.is_float || hdr.pcm.bits > 24)
+        throw std::runtime_error("lossless coding takes integer PCM of up to 24 bits");
+    return float(1u << (hdr.pcm.bits - 1));
+}
+
+// samples [s0, s1) of every channel as LOSSLESS_BLOCK blocks into sw
+inline SegmentInfo encode_lossless_segment(const Planar &x, size_t s0, size_t s1, const StreamHeader &hdr,
+                                           BitWriter &sw, LosslessScratch &scratch) {
+    const auto el = hdr.channel_elements();
+    const float scale = lossless_scale(hdr);
+    std::vector<std::vector<int32_t>> blk(hdr.ch, std::vector<int32_t>(LOSSLESS_BLOCK));
+    sw.clear();
+    for (size_t b0 = s0; b0 < s1; b0 += LOSSLESS_BLOCK) {
+        size_t n = std::min(LOSSLESS_BLOCK, s1 - b0);
+        for (size_t c = 0; c < hdr.ch; ++c)
+            for (size_t i = 0; i < n; ++i) blk[c][i] = (int32_t)std::lrint(x[c][b0 + i] * scale);
+        write_lossless_block(sw, el, blk, n, hdr.pcm.bits, scratch);
+    }
+    return SegmentInfo{uint64_t(s0 + hdr.hop), uint64_t(s1 - s0), 0};
+}
+
+// Lossless counterpart of encode_stream; hdr must carry STREAM_LOSSLESS
+// and already be written to bw.
+inline void encode_lossless_stream(const Planar &x, const StreamHeader &hdr, BitWriter &bw,
+                                   size_t seg_frames = 0, unsigned threads = 1) {
+    const size_t nsamp = x[0].size();
+    auto ranges = plan_lossless_segments(nsamp, hdr.hop, seg_frames);
+    std::vector<SegmentInfo> segs(ranges.size());
+    std::vector<std::vector<uint8_t>> payloads(ranges.size());
+    auto code = [&](size_t i) {
+        BitWriter sw;
+        LosslessScratch scratch;
+        segs[i] = encode_lossless_segment(x, ranges[i].first, ranges[i].second, hdr, sw, scratch);
+        payloads[i] = sw.bytes();
+        segs[i].bytes = payloads[i].size();
+    };
+    if (threads > 1 && ranges.size() > 1) {
+        ThreadPool pool(std::min<size_t>(threads, ranges.size()));
+        parallel_for(pool, ranges.size(), code);
+    } else {
+        for (size_t i = 0; i < ranges.size(); ++i) code(i);
+    }
+    write_segments(bw, CODING_LOSSLESS, nsamp, segs, payloads);
+}
+
+// ---- decoder ----
+
+// Hybrid decoding one frame at a time. Frame j reads its tracks from the
+// base layer and its residual from the enhancement layer (not at all with
+// STREAM_BASE_ONLY); after it, extended-timeline samples [j*hop, (j+1)*hop)
+// are final, so each frame yields one hop of output.
+struct FrameDecoder {
+    StreamHeader hdr;
+    std::vector<ChannelElement> el;
+    std::vector<size_t> cbands;
+    std::vector<int> pbands;
+    bool psy, pns, enh;
+    size_t pns_first;
+    std::vector<ParametricState> st;
+    MagQ mq;
+    MDCT mdct;
+    std::vector<cpx> X;
+    Planar acc; // track synthesis (coded domain), extended [j*hop, j*hop+hop+nfft)
+    Planar res; // residual (channel domain), extended [j*hop, j*hop+2*hop)
+    Planar C;
+    std::vector<std::vector<uint8_t>> masks;
+    std::vector<std::vector<int>> sf;
+    std::vector<uint8_t> active;
+    std::vector<NoiseBands> noise;
+    SbrBands sb;
+    SbrEnvelopes envc;
+    std::vector<std::vector<int>> env;
+    Planar blk;
+    std::vector<float> S, Y;
+    int s = 0;    // step index
+    size_t j = 0; // frames decoded
+
+    explicit FrameDecoder(const StreamHeader &h)
+        : hdr(h), el(h.channel_elements()), cbands(coupling_bands(h.hop)), psy(h.flags & STREAM_PSY),
+          pns(h.flags & STREAM_PNS), enh(!(h.flags & STREAM_BASE_ONLY)),
+          st(h.ch, ParametricState(h.nfft, h.hop, h.phase_quant())), mdct(h.hop),
+          acc(h.ch, std::vector<float>(h.hop + h.nfft, 0.0f)), res(enh ? h.ch : 0, std::vector<float>(2 * h.hop, 0.0f)),
+          C(h.ch, std::vector<float>(h.hop)), masks(el.size()), sf(psy ? h.ch : 0), noise(h.ch), env(h.ch),
+          blk(h.sbr() ? h.ch : 0, std::vector<float>(2 * h.hop)) {
+        bark_band_edges(2 * (int)h.hop, (int)h.sr, pbands);
+        pns_first = pns_first_band(pbands, h.hop, (int)h.sr);
+        if (h.sbr()) {
+            sb = SbrBands(h.hop, (int)h.sr, h.sbr_hz);
+            envc = SbrEnvelopes(h.ch, sb.size());
+        }
+    }
+
+    // decode the next frame and write the hop it completes to
+    // out[c][pos, pos+hop)
+    void decode(BitReader &base, BitReader &br, Planar &out, size_t pos) {
+        const size_t nfft = hdr.nfft, hop = hdr.hop, ch = hdr.ch;
+        for (const auto &e : el) {
+            for (uint32_t c : {e.a, e.b}) {
+                std::vector<Peak> peaks = decode_tracks(base, st[c], mq);
+                synth_frame(peaks, nfft, hop, X, acc[c], hop);
+                if (!e.pair()) break;
+            }
+        }
+        if (enh) decode_residual_frame(br);
+        emit(out, pos, hop);
+        for (size_t c = 0; c < ch; ++c) {
+            std::copy(acc[c].begin() + hop, acc[c].end(), acc[c].begin());
+            std::fill(acc[c].end() - hop, acc[c].end(), 0.0f);
+        }
+        for (auto &r : res) {
+            std::copy(r.begin() + hop, r.end(), r.begin());
+            std::fill(r.end() - hop, r.end(), 0.0f);
+        }
+        ++j;
+    }
+
+    // the nfft samples still pending after the last frame, to
+    // out[c][pos, pos+nfft)
+    void flush(Planar &out, size_t pos) { emit(out, pos, hdr.nfft); }
+
+private:
+    // the frame's residual block overlap-added into res
+    void decode_residual_frame(BitReader &br) {
+        const size_t hop = hdr.hop, ch = hdr.ch;
+        if (hdr.sbr())
+            for (size_t c = 0; c < ch; ++c) envc.read(br, c, env[c]);
+        for (size_t i = 0; i < el.size(); ++i)
+            if (el[i].pair()) read_ms_mask(br, cbands.size() - 1, masks[i]);
+        const bool noisy = pns && br.get_bit();
+        if (noisy)
+            for (auto &nb : noise) read_noise(br, pbands.size() - 1, pns_first, nb);
+        s += Rice::read_sint(br, 0);
+        if (s < STEP_INDEX_MIN || s > STEP_INDEX_MAX)
+            throw std::runtime_error("bad residual step index");
+        for (size_t c = 0; c < ch; ++c) {
+            decode_residual(br, C[c], ResidualQ(1.0f));
+            if (!psy) {
+                float step = step_for_index(hdr.step, s);
+                for (auto &v : C[c]) v *= step;
+                continue;
+            }
+            active_bands(C[c], pbands, 0.5f, active);
+            read_scalefactors(br, active, sf[c]);
+            for (size_t b = 0; b + 1 < pbands.size(); ++b) {
+                float step = step_for_index(hdr.step, s + sf[c][b]);
+                for (int k = pbands[b]; k < pbands[b + 1]; ++k) C[c][k] *= step;
+            }
+        }
+        if (noisy)
+            for (size_t c = 0; c < ch; ++c) fill_noise(C[c], pbands, noise[c], uint32_t(j * ch + c));
+        for (size_t i = 0; i < el.size(); ++i)
+            if (el[i].pair()) rotate_bands(C[el[i].a], C[el[i].b], cbands, masks[i]);
+        if (hdr.sbr()) {
+            // the block's track synthesis is final once this frame is in;
+            // the high band is patched from tracks plus residual and stored
+            // as the residual's share of it
+            for (size_t c = 0; c < ch; ++c) std::copy(acc[c].begin(), acc[c].begin() + 2 * hop, blk[c].begin());
+            rotate_planes(el, blk, 0, 2 * hop);
+            for (size_t c = 0; c < ch; ++c) {
+                mdct.forward(blk[c], 0, S);
+                Y.resize(hop);
+                for (size_t k = 0; k < hop; ++k) Y[k] = S[k] + C[c][k];
+                sbr_patch(Y, sb, env[c], uint32_t(j * ch + c) ^ 0x5B5B5B5Bu);
+                for (size_t k = sb.cross; k < hop; ++k) C[c][k] = Y[k] - S[k];
+            }
+        }
+        for (size_t c = 0; c < ch; ++c) mdct.inverse(C[c], res[c], 0);
+    }
+
+    // tracks back in the channel domain plus residual, first n samples
+    void emit(Planar &out, size_t pos, size_t n) {
+        n = std::min(n, out[0].size() - std::min(pos, out[0].size()));
+        for (size_t c = 0; c < hdr.ch; ++c) std::copy(acc[c].begin(), acc[c].begin() + n, out[c].begin() + pos);
+        rotate_planes(el, out, pos, pos + n);
+        for (size_t c = 0; c < res.size(); ++c)
+            for (size_t k = 0; k < std::min(n, res[c].size()); ++k) out[c][pos + k] += res[c][k];
+    }
+};
+
+// decode one segment into segment-local extended-timeline buffers, one per
+// channel
+inline void decode_hybrid_segment(BitReader &br, const SegmentInfo &seg,
+                                  const StreamHeader &hdr, Planar &out) {
+    BitReader base = br.take(seg.base); // br goes on with the enhancement layer
+    size_t frames = seg.count > hdr.nfft ? (seg.count - hdr.nfft) / hdr.hop : 0;
+    out.assign(hdr.ch, std::vector<float>(seg.count, 0.0f));
+    FrameDecoder dec(hdr);
+    for (size_t f = 0; f < frames; ++f) dec.decode(base, br, out, f * hdr.hop);
+    dec.flush(out, frames * hdr.hop);
+}
+
+// Lossless block reader: each call decodes the next block of n samples per
+// channel to out[c][pos, pos+n).
+class LosslessDecoder {
+    const StreamHeader &hdr;
+    std::vector<ChannelElement> el;
+    float inv;
+    std::vector<std::vector<int32_t>> blk;
+    std::vector<int32_t> res;
+
+public:
+    explicit LosslessDecoder(const StreamHeader &h)
+        : hdr(h), el(h.channel_elements()), inv(1.0f / lossless_scale(h)),
+          blk(h.ch, std::vector<int32_t>(LOSSLESS_BLOCK)) {}
+
+    void decode(BitReader &br, size_t n, Planar &out, size_t pos) {
+        read_lossless_block(br, el, blk, n, hdr.pcm.bits, res);
+        for (size_t c = 0; c < hdr.ch; ++c)
+            for (size_t i = 0; i < n; ++i) out[c][pos + i] = float(blk[c][i]) * inv;
+    }
+};
+
+inline void decode_lossless_segment(BitReader &br, const SegmentInfo &seg, const StreamHeader &hdr,
+                                    Planar &out) {
+    out.assign(hdr.ch, std::vector<float>(seg.count, 0.0f));
+    LosslessDecoder dec(hdr);
+    for (size_t b0 = 0; b0 < seg.count; b0 += LOSSLESS_BLOCK)
+        dec.decode(br, std::min<size_t>(LOSSLESS_BLOCK, seg.count - b0), out, b0);
+}
+
+inline void decode_segment(BitReader &br, uint32_t coding, const SegmentInfo &seg,
+                           const StreamHeader &hdr, Planar &out) {
+    switch (coding) {
+    case CODING_HYBRID: decode_hybrid_segment(br, seg, hdr, out); break;
+    case CODING_LOSSLESS: decode_lossless_segment(br, seg, hdr, out); break;
+    default: throw std::runtime_error("Unknown segment coding");
+    }
+}
+
+// parsed segment table with one independent reader per segment
+struct StreamLayout {
+    uint32_t coding = CODING_HYBRID;
+    size_t nsamp = 0; // samples per channel
+    std::vector<SegmentInfo> segs;
+    std::vector<BitReader> readers;
+};
+
+inline StreamLayout read_segments(BitReader &br) {
+    StreamLayout L;
+    L.coding = br.read32();
+    L.nsamp = size_t(br.read64());
+    uint32_t nseg = br.read32();
+    const size_t entry = L.coding == CODING_HYBRID ? 32 : 24; // table bytes per segment
+    if (nseg > br.bytes_left() / entry) throw std::runtime_error("bad segment table (segment count)");
+    L.segs.resize(nseg);
+    for (auto &s : L.segs) {
+        s.first = br.read64();
+        s.count = br.read64();
+        s.bytes = br.read64();
+        if (L.coding == CODING_HYBRID) {
+            s.base = br.read64();
+            if (s.base > s.bytes) throw std::runtime_error("bad segment table (base layer)");
+        }
+    }
+    br.align_byte();
+
+    // payload sizes come from the file: check each against what is left
+    // before slicing, so a corrupt table cannot wrap the offset
+    L.readers.reserve(L.segs.size());
+    size_t offset = br.byte_pos();
+    for (const auto &s : L.segs) {
+        if (s.bytes > br.bytes_left() - (offset - br.byte_pos()))
+            throw std::runtime_error("bad segment table (payload past the end)");
+        L.readers.push_back(br.slice(offset, size_t(s.bytes)));
+        offset += size_t(s.bytes);
+    }
+    return L;
+}
+
+// drop the one-hop lead of the extended timeline and trim to nsamp
+inline void finish_output(std::vector<float> &ext, size_t nsamp, const StreamHeader &hdr) {
+    size_t lead = std::min<size_t>(hdr.hop, ext.size());
+    ext.erase(ext.begin(), ext.begin() + lead);
+    ext.resize(nsamp, 0.0f);
+}
+
+// pcm receives hdr.ch interleaved channels; threads > 1 decodes segments
+// concurrently on a pool
+inline void decode_stream(std::vector<float> &pcm, const StreamHeader &hdr,
+                          BitReader &br, unsigned threads = 1) {
+    StreamLayout L = read_segments(br);
+    size_t nseg = L.segs.size();
+
+    std::vector<Planar> outs(nseg);
+    auto decode_one = [&](size_t i) {
+        decode_segment(L.readers[i], L.coding, L.segs[i], hdr, outs[i]);
+    };
+    if (threads > 1 && nseg > 1) {
+        ThreadPool pool(std::min<size_t>(threads, nseg));
+        parallel_for(pool, nseg, decode_one);
+    } else {
+        for (size_t i = 0; i < nseg; ++i) decode_one(i);
+    }
+
+    Planar y(hdr.ch, std::vector<float>(extended_length(L.nsamp, hdr), 0.0f));
+    for (size_t i = 0; i < nseg; ++i) stitch_segment(y, L.segs[i], outs[i]);
+    for (auto &c : y) finish_output(c, L.nsamp, hdr);
+    interleave(y, pcm);
+}
+
+// receives n samples per channel of decoded output, in order
+using PcmSink = std::function<void(const Planar &y, size_t n)>;
+
+// Overlap-add window over the extended timeline for decoding segments in
+// order: add() sums output in at absolute positions, release(p) declares
+// everything before p complete and hands it to the sink, less the one-hop
+// lead and anything past nsamp. Only the span between the release point
+// and the furthest write is held.
+class OutputWindow {
+    Planar buf, chunk;
+    size_t base = 0; // extended position of buf[.][0]
+    size_t lead, end;
+    const PcmSink &sink;
+
+    void grow(size_t n) {
+        for (auto &b : buf)
+            if (b.size() < n) b.resize(n, 0.0f);
+    }
+
+public:
+    OutputWindow(const StreamHeader &hdr, size_t nsamp, const PcmSink &sink_)
+        : buf(hdr.ch), chunk(hdr.ch), lead(hdr.hop), end(hdr.hop + nsamp), sink(sink_) {}
+
+    void add(size_t pos, const Planar &y, size_t n) {
+        if (pos < base) throw std::runtime_error("output window overrun");
+        grow(pos - base + n);
+        for (size_t c = 0; c < buf.size(); ++c)
+            for (size_t k = 0; k < n; ++k) buf[c][pos - base + k] += y[c][k];
+    }
+
+    void release(size_t p) {
+        if (p <= base) return;
+        const size_t m = p - base;
+        grow(m);
+        const size_t a = std::max(base, lead), b = std::min(p, end);
+        if (b > a) {
+            for (size_t c = 0; c < buf.size(); ++c)
+                chunk[c].assign(buf[c].begin() + (a - base), buf[c].begin() + (b - base));
+            sink(chunk, b - a);
+        }
+        for (auto &v : buf) v.erase(v.begin(), v.begin() + m);
+        base = p;
+    }
+
+    void finish() { release(end); }
+};
+
+// Serial decode that streams the output: segments are decoded in order,
+// frame by frame (hybrid) or block by block (lossless), and each stretch
+// of samples goes to the sink as soon as no later frame can add to it.
+// Memory is a frame's worth of state, not the file.
+inline void decode_stream_to(const StreamHeader &hdr, BitReader &br, const PcmSink &sink) {
+    StreamLayout L = read_segments(br);
+    OutputWindow w(hdr, L.nsamp, sink);
+    const size_t hop = hdr.hop, nfft = hdr.nfft;
+    Planar tmp(hdr.ch, std::vector<float>(std::max<size_t>(nfft, LOSSLESS_BLOCK), 0.0f));
+    for (size_t i = 0; i < L.segs.size(); ++i) {
+        const SegmentInfo &seg = L.segs[i];
+        BitReader &r = L.readers[i];
+        if (L.coding == CODING_HYBRID) {
+            BitReader base = r.take(seg.base); // r goes on with the enhancement layer
+            size_t frames = seg.count > nfft ? (seg.count - nfft) / hop : 0;
+            FrameDecoder dec(hdr);
+            for (size_t f = 0; f < frames; ++f) {
+                dec.decode(base, r, tmp, 0);
+                w.add(seg.first + f * hop, tmp, hop);
+                w.release(seg.first + (f + 1) * hop);
+            }
+            dec.flush(tmp, 0);
+            w.add(seg.first + frames * hop, tmp, nfft);
+        } else if (L.coding == CODING_LOSSLESS) {
+            LosslessDecoder dec(hdr);
+            for (size_t b0 = 0; b0 < seg.count; b0 += LOSSLESS_BLOCK) {
+                size_t n = std::min<size_t>(LOSSLESS_BLOCK, seg.count - b0);
+                dec.decode(r, n, tmp, 0);
+                w.add(seg.first + b0, tmp, n);
+                w.release(seg.first + b0 + n);
+            }
+        } else {
+            throw std::runtime_error("Unknown segment coding");
+        }
+    }
+    w.finish();
+}
+
+// Gain for the decoded output. Lossless and low-delay streams, and
+// streams whose encoder measured no level, play at unit gain. Otherwise
+// the source's peak is scaled to 0.999, or, with a target, its RMS is
+// brought to target_dbfs; overs are left to the limiter.
+inline float output_gain(const StreamHeader &hdr, bool loudness = false, float target_dbfs = 0.0f) {
+    if (hdr.flags & (STREAM_LOSSLESS | STREAM_LOW_DELAY)) return 1.0f;
+    if (loudness) return hdr.rms_ref > 1e-9f ? std::pow(10.0f, target_dbfs / 20.0f) / hdr.rms_ref : 1.0f;
+    return hdr.peak_ref > 1e-9f ? 0.999f / hdr.peak_ref : 1.0f;
+}
+
+// Lossy output goes out at gain through the look-ahead limiter; lossless
+// and low-delay output is written as decoded. sample_rate is the file's,
+// 0 for the stream's own.
+inline void set_output_stage(WavWriter &w, const StreamHeader &hdr, float gain, int sample_rate = 0) {
+    if (hdr.flags & (STREAM_LOSSLESS | STREAM_LOW_DELAY)) return;
+    w.set_gain(gain);
+    w.set_limiter(sample_rate ? sample_rate : int(hdr.sr));
+}
+
+// Copy a hybrid stream without its enhancement layer: the header gains
+// STREAM_BASE_ONLY and each segment keeps only its base bytes, so the
+// result decodes as tracks alone. Nothing is re-encoded.
+inline void strip_enhancement(BitReader &br, BitWriter &bw) {
+    StreamHeader hdr = StreamHeader::read(br);
+    StreamLayout L = read_segments(br);
+    if (L.coding != CODING_HYBRID) throw std::runtime_error("stream has no enhancement layer");
+    hdr.flags |= STREAM_BASE_ONLY;
+    hdr.write(bw);
+    std::vector<std::vector<uint8_t>> payloads(L.segs.size());
+    for (size_t i = 0; i < L.segs.size(); ++i) {
+        payloads[i] = L.readers[i].read_bytes(L.segs[i].base);
+        L.segs[i].bytes = L.segs[i].base;
     }
+    write_segments(bw, L.coding, L.nsamp, L.segs, payloads);
 }
 
 } // namespace wofl
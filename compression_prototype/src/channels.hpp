@@ -0,0 +1,171 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+#include <cmath>
+#include "bitio.hpp"
+#include "fft.hpp"
+
+namespace wofl {
+
+// one contiguous buffer per channel
+using Planar = std::vector<std::vector<float>>;
+
+inline Planar deinterleave(const std::vector<float> &pcm, size_t ch) {
+    ch = std::max<size_t>(ch, 1);
+    size_t n = pcm.size() / ch;
+    Planar x(ch, std::vector<float>(n));
+    for (size_t i = 0; i < n; ++i)
+        for (size_t c = 0; c < ch; ++c) x[c][i] = pcm[i * ch + c];
+    return x;
+}
+
+inline void interleave(const Planar &x, std::vector<float> &pcm) {
+    size_t ch = x.size(), n = ch ? x[0].size() : 0;
+    pcm.resize(n * ch);
+    for (size_t i = 0; i < n; ++i)
+        for (size_t c = 0; c < ch; ++c) pcm[i * ch + c] = x[c][i];
+}
+
+// Channels are coded in elements: a single channel, or an L/R pair coded as
+// mid/side where that is cheaper. Element channels keep their own indices,
+// so for a pair, channel a carries mid and b carries side in the coded domain.
+struct ChannelElement {
+    uint32_t a = 0;
+    uint32_t b = 0;
+    bool pair() const { return a != b; }
+};
+
+// Left/right speaker pairs worth coupling, as WAVE_FORMAT_EXTENSIBLE
+// channel-mask bits: front, back, front-of-centre, side, top front, top back.
+constexpr uint32_t SPEAKER_PAIRS[][2] = {
+    {0x1, 0x2}, {0x10, 0x20}, {0x40, 0x80}, {0x200, 0x400}, {0x1000, 0x4000}, {0x8000, 0x20000},
+};
+
+// Elements for ch channels laid out by a channel mask (0 = unknown). WAV
+// channels follow the order of the mask bits, so a speaker's channel index
+// is the number of mask bits below it. Without a mask only plain stereo is
+// paired; other layouts (including ambisonics, whose components do not form
+// L/R pairs) are coded as independent channels. Elements are ordered by
+// their first channel.
+inline std::vector<ChannelElement> plan_elements(size_t ch, uint32_t mask = 0) {
+    std::vector<int> partner(ch, -1);
+    if (mask == 0) {
+        if (ch == 2) partner = {1, 0};
+    } else {
+        auto index = [&](uint32_t bit) {
+            uint32_t below = mask & (bit - 1);
+            int n = 0;
+            while (below) { below &= below - 1; ++n; }
+            return (mask & bit) && size_t(n) < ch ? n : -1;
+        };
+        for (const auto &p : SPEAKER_PAIRS) {
+            int l = index(p[0]), r = index(p[1]);
+            if (l >= 0 && r >= 0) { partner[l] = r; partner[r] = l; }
+        }
+    }
+    std::vector<ChannelElement> el;
+    for (uint32_t c = 0; c < ch; ++c) {
+        if (partner[c] < 0) el.push_back({c, c});
+        else if (uint32_t(partner[c]) > c) el.push_back({c, uint32_t(partner[c])});
+    }
+    return el;
+}
+
+// every channel in exactly one element
+inline bool valid_elements(const std::vector<ChannelElement> &el, size_t ch) {
+    std::vector<int> seen(ch, 0);
+    for (const auto &e : el) {
+        if (e.a >= ch || e.b >= ch) return false;
+        seen[e.a]++;
+        if (e.pair()) seen[e.b]++;
+    }
+    return std::all_of(seen.begin(), seen.end(), [](int n) { return n == 1; });
+}
+
+// Orthonormal L/R <-> M/S rotation. It is its own inverse and keeps
+// quantization noise power unchanged, so one step serves both domains.
+constexpr float SQRT1_2 = 0.70710678118654752f;
+
+template <typename T>
+inline void rotate_ms(T &a, T &b) {
+    T m = (a + b) * SQRT1_2;
+    T s = (a - b) * SQRT1_2;
+    a = m;
+    b = s;
+}
+
+// L/R spectra of a pair -> M/S
+inline void couple_spectra(const ChannelElement &e, std::vector<std::vector<cpx>> &X) {
+    if (!e.pair()) return;
+    for (size_t k = 0; k < X[e.a].size(); ++k) rotate_ms(X[e.a][k], X[e.b][k]);
+}
+
+// rotate samples [begin, end) of a pair (coded <-> channel domain)
+inline void rotate_planes(const ChannelElement &e, Planar &y, size_t begin, size_t end) {
+    if (!e.pair()) return;
+    size_t n = std::min({end, y[e.a].size(), y[e.b].size()});
+    for (size_t i = begin; i < n; ++i) rotate_ms(y[e.a][i], y[e.b][i]);
+}
+
+inline void rotate_planes(const std::vector<ChannelElement> &el, Planar &y, size_t begin, size_t end) {
+    for (const auto &e : el) rotate_planes(e, y, begin, end);
+}
+
+// Band edges for the per-band L/R vs M/S decision on n MDCT bins: four bins
+// at the bottom, then about a quarter of the band's start frequency.
+inline std::vector<size_t> coupling_bands(size_t n) {
+    std::vector<size_t> edges{0};
+    while (edges.back() < n) edges.push_back(std::min(n, edges.back() + std::max<size_t>(4, edges.back() / 4)));
+    return edges;
+}
+
+// Pick M/S for a band when it has the smaller L1 norm (a good proxy for
+// the coded size of Laplacian-like MDCT coefficients), then rotate those
+// bands of A/B into M/S in place.
+inline void choose_ms(std::vector<float> &A, std::vector<float> &B, const std::vector<size_t> &bands,
+                      std::vector<uint8_t> &mask) {
+    mask.assign(bands.size() - 1, 0);
+    for (size_t j = 0; j + 1 < bands.size(); ++j) {
+        float lr = 0.0f, ms = 0.0f;
+        for (size_t k = bands[j]; k < bands[j + 1]; ++k) {
+            float a = A[k], b = B[k];
+            lr += std::fabs(a) + std::fabs(b);
+            ms += (std::fabs(a + b) + std::fabs(a - b)) * SQRT1_2;
+        }
+        mask[j] = ms < lr;
+    }
+    for (size_t j = 0; j + 1 < bands.size(); ++j)
+        if (mask[j])
+            for (size_t k = bands[j]; k < bands[j + 1]; ++k) rotate_ms(A[k], B[k]);
+}
+
+// undo choose_ms on decoded coefficients
+inline void rotate_bands(std::vector<float> &A, std::vector<float> &B, const std::vector<size_t> &bands,
+                         const std::vector<uint8_t> &mask) {
+    for (size_t j = 0; j + 1 < bands.size(); ++j)
+        if (mask[j])
+            for (size_t k = bands[j]; k < bands[j + 1]; ++k) rotate_ms(A[k], B[k]);
+}
+
+// one flag when every band agrees, else one bit per band
+inline void write_ms_mask(BitWriter &bw, const std::vector<uint8_t> &mask) {
+    bool uniform = std::all_of(mask.begin(), mask.end(), [&](uint8_t m) { return m == mask[0]; });
+    bw.put_bit(uniform);
+    if (uniform) {
+        bw.put_bit(mask.empty() ? 0 : mask[0]);
+    } else {
+        for (uint8_t m : mask) bw.put_bit(m);
+    }
+}
+
+inline void read_ms_mask(BitReader &br, size_t nbands, std::vector<uint8_t> &mask) {
+    if (br.get_bit()) {
+        mask.assign(nbands, (uint8_t)br.get_bit());
+    } else {
+        mask.resize(nbands);
+        for (auto &m : mask) m = (uint8_t)br.get_bit();
+    }
+}
+
+} // namespace wofl
@@ -1,37 +1,102 @@
 #include <iostream>
 #include <string>
+#include <vector>
 #include "wav.hpp"
 #include "analysis.hpp"
 #include "parametric.hpp"
 #include "residual.hpp"
 #include "bitstream.hpp"
+#include "resample.hpp"
+#include "batch.hpp"
 
 int main(int argc, char** argv) {
-    if (argc < 3) {
-        std::cerr << "Usage: decoder <input.bin> <output.wav>" << std::endl;
+    std::vector<std::string> paths;
+    unsigned threads = 0; // 0 = serial for one file, all cores for a batch
+    std::string manifest;
+    wofl::DecodeParams params; // output stage, the same for --batch
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--",0)!=0) paths.push_back(arg);
+        if (arg.rfind("--threads=",0)==0) threads = (unsigned)std::stoul(arg.substr(10));
+        if (arg.rfind("--batch=",0)==0) manifest = arg.substr(8);
+        if (arg == "--base-only") params.base_only = true;
+        if (arg.rfind("--pcm=",0)==0) { params.pcm_given = true; params.pcm = wofl::parse_pcm_format(arg.substr(6)); }
+        if (arg == "--limit") params.limit = true;
+        if (arg.rfind("--rate=",0)==0) params.out_rate = std::stoi(arg.substr(7));
+        if (arg.rfind("--loudness=",0)==0) { params.loudness = true; params.target_dbfs = std::stof(arg.substr(11)); }
+    }
+
+    if (params.out_rate < 0) {
+        std::cerr << "--rate must be positive" << std::endl;
         return 1;
     }
 
-    std::string inpath = argv[1];
-    std::string outpath = argv[2];
+    if (!manifest.empty()) {
+        std::vector<wofl::BatchJob> jobs = wofl::read_manifest(manifest);
+        wofl::ThreadPool pool(threads);
+        size_t failed = wofl::decode_batch(jobs, pool, params);
+        std::cout << "Batch: " << (jobs.size() - failed) << "/" << jobs.size()
+                  << " files decoded on " << pool.size() << " threads" << std::endl;
+        return failed ? 1 : 0;
+    }
+
+    if (paths.size() < 2) {
+        std::cerr << "Usage: decoder <input.bin> <output.wav> [--base-only] [--pcm=8|16|24|32|f32|f64] [--limit] [--loudness=DBFS] [--rate=HZ] [--threads=N]" << std::endl;
+        std::cerr << "       decoder --batch=<manifest> [--threads=N] [options]" << std::endl;
+        return 1;
+    }
+
+    std::string inpath = paths[0];
+    std::string outpath = paths[1];
 
     wofl::BitReader br(inpath);
-    size_t nfft = br.read32();
-    size_t hop = br.read32();
-    int sr = br.read32();
-    int ch = br.read32();
+    wofl::StreamHeader hdr = wofl::StreamHeader::read(br);
+    if (params.base_only) hdr.flags |= wofl::STREAM_BASE_ONLY;
+    size_t nfft = hdr.nfft;
+    size_t hop = hdr.hop;
+    int sr = hdr.sr;
+    int ch = hdr.ch;
 
     std::cout << "Metadata loaded: frame_size=" << nfft
               << " hop_size=" << hop
               << " sample_rate=" << sr
-              << " channels=" << ch << std::endl;
-
-    std::vector<float> pcm;
-    wofl::decode_stream(pcm, sr, ch, nfft, hop, br);
+              << " channels=" << ch
+              << " format=" << (hdr.pcm.is_float ? "f" : "") << hdr.pcm.bits
+              << " elements=" << hdr.elements.size() << std::endl;
 
-    std::cout << "Decoded " << pcm.size() << " samples @ " << sr << " Hz" << std::endl;
+    // lossy output is scaled to the source's level as the encoder measured
+    // it and limited on the fly, so it is written as it is decoded; the
+    // resampler, when the rate changes, sits in front of the writer
+    const int file_sr = params.out_rate ? params.out_rate : sr;
+    wofl::WavWriter w(outpath, file_sr, ch, hdr.channel_mask, params.format(hdr));
+    wofl::set_output_stage(w, hdr, params.gain(hdr), file_sr);
+    std::unique_ptr<wofl::Resampler> rs;
+    if (file_sr != sr) rs = std::make_unique<wofl::Resampler>(ch, sr, file_sr);
+    std::vector<float> pcm, out;
+    auto put = [&](const float* x, size_t frames) {
+        if (!rs) return w.write(x, frames);
+        out.clear();
+        rs->process(x, frames, out);
+        w.write(out.data(), out.size() / ch);
+    };
+    if (threads > 1) {
+        wofl::decode_stream(pcm, hdr, br, threads);
+        put(pcm.data(), pcm.size() / ch);
+    } else {
+        wofl::decode_stream_to(hdr, br, [&](const wofl::Planar &y, size_t n) {
+            wofl::interleave(y, pcm);
+            put(pcm.data(), n);
+        });
+    }
+    if (rs) {
+        out.clear();
+        rs->flush(out);
+        w.write(out.data(), out.size() / ch);
+    }
+    w.close();
 
-    wofl::normalize_and_write(pcm, outpath, sr, ch);
+    std::cout << "Decoded " << w.frames_written() * ch << " samples @ " << file_sr << " Hz" << std::endl;
 
     return 0;
 }
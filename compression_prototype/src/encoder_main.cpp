@@ -1,52 +1,221 @@
 #include <iostream>
 #include <string>
+#include <vector>
 #include "wav.hpp"
+#include "wavmap.hpp"
+#include "resample.hpp"
 #include "analysis.hpp"
 #include "parametric.hpp"
 #include "residual.hpp"
 #include "bitstream.hpp"
+#include "pipeline.hpp"
+#include "lowdelay.hpp"
+#include "batch.hpp"
 
 int main(int argc, char** argv) {
-    if (argc < 3) {
-        std::cerr << "Usage: encoder <input.wav> <output.bin> [--nfft=N] [--hop=H] [--K=K]" << std::endl;
-        return 1;
-    }
-
-    std::string inpath = argv[1];
-    std::string outpath = argv[2];
+    std::vector<std::string> paths;
     size_t nfft = 2048;
     size_t hop = 512;
-    int K = 128;
+    bool hop_given = false;
+    wofl::TrackSelect sel; // K and peak ranking
+    float step = 0.004f;   // residual quantizer step
+    size_t seg_frames = 0; // 0 = one segment
+    bool live = false;
+    std::string manifest;
+    unsigned threads = 0;  // batch mode: 0 = all cores; one file: 0 = serial
+    wofl::RateParams rate; // off = fixed quality at --step
+    bool psy = true;       // masking-model scalefactors on the residual
+    bool pns = true;       // noise substitution for noise-like residual bands
+    uint32_t sbr_hz = 0;   // bandwidth extension crossover, 0 = full band
+    int resample_hz = 0;   // code at this rate, 0 = the input's
+    bool lossless = false; // LPC + Rice blocks, exact round trip
+    bool low_delay = false; // short frames coded one by one, unit-gain output
+    wofl::PhaseQ phase;    // track phase resolution and predictor order
 
-    for (int i = 3; i < argc; ++i) {
+    for (int i = 1; i < argc; ++i) {
         std::string arg = argv[i];
+        if (arg.rfind("--",0)!=0) paths.push_back(arg);
         if (arg.rfind("--nfft=",0)==0) nfft = std::stoul(arg.substr(7));
-        if (arg.rfind("--hop=",0)==0) hop = std::stoul(arg.substr(6));
-        if (arg.rfind("--K=",0)==0) K = std::stoi(arg.substr(4));
+        if (arg.rfind("--hop=",0)==0) { hop = std::stoul(arg.substr(6)); hop_given = true; }
+        if (arg.rfind("--K=",0)==0) sel.K = std::stoi(arg.substr(4));
+        if (arg == "--rank=magnitude") sel.rank = wofl::PeakRank::Magnitude;
+        if (arg == "--rank=salience") sel.rank = wofl::PeakRank::Salience;
+        if (arg.rfind("--min-smr=",0)==0) sel.min_smr_db = std::stof(arg.substr(10));
+        if (arg.rfind("--step=",0)==0) step = std::stof(arg.substr(7));
+        if (arg.rfind("--segment=",0)==0) seg_frames = std::stoul(arg.substr(10));
+        if (arg == "--live") live = true;
+        if (arg == "--no-psy") psy = false;
+        if (arg == "--no-pns") pns = false;
+        if (arg == "--lossless") lossless = true;
+        if (arg == "--low-delay") low_delay = true;
+        if (arg.rfind("--sbr=",0)==0) sbr_hz = (uint32_t)std::stoul(arg.substr(6));
+        if (arg.rfind("--resample=",0)==0) resample_hz = std::stoi(arg.substr(11));
+        if (arg.rfind("--batch=",0)==0) manifest = arg.substr(8);
+        if (arg.rfind("--threads=",0)==0) threads = (unsigned)std::stoul(arg.substr(10));
+        if (arg.rfind("--cbr=",0)==0) rate = {wofl::RateMode::CBR, std::stod(arg.substr(6))};
+        if (arg.rfind("--abr=",0)==0) rate = {wofl::RateMode::ABR, std::stod(arg.substr(6))};
+        if (arg.rfind("--phase-bits=",0)==0) phase.track_bits = (uint32_t)std::stoul(arg.substr(13));
+        if (arg.rfind("--birth-phase-bits=",0)==0) phase.birth_bits = (uint32_t)std::stoul(arg.substr(19));
+        if (arg.rfind("--phase-order=",0)==0) phase.second_order = std::stoi(arg.substr(14)) >= 2;
     }
 
-    wofl::WavData w = wofl::read_wav(inpath);
-    auto pcm = w.samples;
-    int sr = w.sample_rate;
-    int ch = w.channels;
+    // with --low-delay nfft follows the hop; without --hop both are sized
+    // from the coded rate once the input is open
+    if (low_delay) nfft = wofl::LOW_DELAY_OVERLAP * hop;
+
+    auto pow2 = [](size_t v) { return v >= 2 && (v & (v - 1)) == 0; };
+    if (!pow2(nfft) || !pow2(hop) || hop > nfft) {
+        std::cerr << "nfft and hop must be powers of two with hop <= nfft" << std::endl;
+        return 1;
+    }
+    for (uint32_t b : {phase.track_bits, phase.birth_bits}) {
+        if (b < wofl::PHASE_BITS_MIN || b > wofl::PHASE_BITS_MAX) {
+            std::cerr << "phase bits must be in [" << wofl::PHASE_BITS_MIN << ", " << wofl::PHASE_BITS_MAX << "]" << std::endl;
+            return 1;
+        }
+    }
+    if (rate.mode != wofl::RateMode::Off && !(rate.kbps > 0.0)) {
+        std::cerr << "target bitrate must be positive" << std::endl;
+        return 1;
+    }
+    if (resample_hz < 0 || (resample_hz && lossless)) {
+        std::cerr << "--resample takes a positive rate and does not combine with --lossless" << std::endl;
+        return 1;
+    }
+
+    if (!manifest.empty()) {
+        // many input/output pairs on one work-stealing pool
+        std::vector<wofl::BatchJob> jobs = wofl::read_manifest(manifest);
+        wofl::ThreadPool pool(threads);
+        wofl::EncodeParams params{nfft, low_delay && !hop_given ? 0 : hop, sel, step, seg_frames, rate, psy, pns,
+                                    phase, sbr_hz, lossless, low_delay, resample_hz};
+        size_t failed = wofl::encode_batch(jobs, params, pool);
+        std::cout << "Batch: " << (jobs.size() - failed) << "/" << jobs.size()
+                  << " files encoded on " << pool.size() << " threads" << std::endl;
+        return failed ? 1 : 0;
+    }
+
+    if (paths.size() < 2) {
+        std::cerr << "Usage: encoder <input.wav> <output.bin> [--nfft=N] [--hop=H] [--K=K] [--rank=salience|magnitude] [--min-smr=DB] [--step=S] [--segment=F] [--live] [--cbr=KBPS|--abr=KBPS] [--no-psy] [--no-pns] [--sbr=HZ] [--lossless] [--low-delay] [--resample=HZ] [--phase-bits=B] [--birth-phase-bits=B] [--phase-order=1|2] [--threads=N]" << std::endl;
+        std::cerr << "       encoder --batch=<manifest> [--threads=N] [options]" << std::endl;
+        return 1;
+    }
+
+    std::string inpath = paths[0];
+    std::string outpath = paths[1];
+
+    wofl::WavReader wav(inpath);
+    int in_sr = wav.sample_rate();
+    int sr = resample_hz ? resample_hz : in_sr; // the coded rate
+    int ch = wav.channels();
+    if (low_delay && !hop_given) {
+        hop = wofl::low_delay_hop((uint32_t)sr);
+        nfft = wofl::LOW_DELAY_OVERLAP * hop;
+    }
+    wofl::PcmFormat format = wav.format();
+    if (sbr_hz && (sbr_hz < wofl::SBR_MIN_HZ || 2 * sbr_hz >= (uint32_t)sr)) {
+        std::cerr << "--sbr crossover must be in [" << wofl::SBR_MIN_HZ << ", " << sr / 2 << ") Hz" << std::endl;
+        return 1;
+    }
+    if (lossless && (format.is_float || format.bits > 24)) {
+        std::cerr << "--lossless takes integer PCM of up to 24 bits" << std::endl;
+        return 1;
+    }
+
+    // the live encoder streams the file block by block; the other modes
+    // take it whole, converted from a mapping of the file, or read through
+    // the stream when it cannot be mapped (a pipe)
+    bool streaming = live && !lossless && !low_delay;
+    wofl::Planar x; // one plane per channel, no interleaved copy
+    if (!streaming) x = wofl::read_wav_planes(inpath, wav);
+    if (!streaming && sr != in_sr) wofl::resample_planes(x, in_sr, sr);
+    size_t nsamp = streaming ? 0 : x[0].size(); // per channel; counted as read when streaming
 
     std::cout << "Frame config: frame_size=" << nfft
               << " hop_size=" << hop
-              << " -> total_frames=" << (pcm.size()/hop) << std::endl;
-    std::cout << "Top-K=" << K << std::endl;
+              << " channels=" << ch
+              << " format=" << (format.is_float ? "f" : "") << format.bits;
+    if (wav.frames() != wofl::WavReader::UNKNOWN_FRAMES)
+        std::cout << " -> total_frames="
+                  << wofl::num_frames((wav.frames() * uint64_t(sr) + uint64_t(in_sr) - 1) / uint64_t(in_sr), hop);
+    std::cout << std::endl;
+    if (sr != in_sr) std::cout << "Resampled " << in_sr << " -> " << sr << " Hz" << std::endl;
+    std::cout << "Top-K=" << sel.K;
+    if (sel.rank == wofl::PeakRank::Salience) std::cout << " (salience, SMR >= " << sel.min_smr_db << " dB)";
+    std::cout << std::endl;
+    if (seg_frames) std::cout << "Segment length=" << seg_frames << " hops" << std::endl;
+    if (rate.mode != wofl::RateMode::Off)
+        std::cout << (rate.mode == wofl::RateMode::CBR ? "CBR " : "ABR ") << rate.kbps << " kbit/s" << std::endl;
 
     // Encode
     wofl::BitWriter bw;
-    bw.write32(nfft);
-    bw.write32(hop);
-    bw.write32(sr);
-    bw.write32(ch);
+    wofl::StreamHeader hdr;
+    hdr.nfft = (uint32_t)nfft;
+    hdr.hop = (uint32_t)hop;
+    hdr.sr = (uint32_t)sr;
+    hdr.ch = (uint32_t)ch;
+    hdr.step = step;
+    hdr.flags = (psy ? wofl::STREAM_PSY : 0u) | (phase.second_order ? wofl::STREAM_PHASE2 : 0u) |
+                (pns ? wofl::STREAM_PNS : 0u) | (sbr_hz ? wofl::STREAM_SBR : 0u);
+    hdr.sbr_hz = sbr_hz;
+    if (low_delay) wofl::low_delay_profile(hdr, hop);
+    if (lossless) hdr.flags = wofl::STREAM_LOSSLESS;
+    hdr.track_phase_bits = phase.track_bits;
+    hdr.birth_phase_bits = phase.birth_bits;
+    hdr.channel_mask = wav.channel_mask();
+    hdr.pcm = format;
+    // the decoder sets its output level from these; streamed input is
+    // measured as it is read and the header rewritten at the end
+    wofl::LevelMeter level;
+    for (const auto &c : x) level.add(c.data(), c.size());
+    hdr.peak_ref = level.peak;
+    hdr.rms_ref = level.rms();
+    hdr.elements = hdr.channel_elements();
+    hdr.write(bw);
+    std::cout << "Channel elements=" << hdr.elements.size() << std::endl;
 
-    // analysis + parametric/residual encoding
-    wofl::encode_stream(pcm, sr, ch, nfft, hop, K, bw);
+    if (lossless) {
+        // LPC + Rice blocks; the lossy options do not apply
+        wofl::encode_lossless_stream(x, hdr, bw, seg_frames, threads);
+    } else if (low_delay) {
+        // frame by frame through the push/pull encoder, one segment
+        wofl::encode_low_delay(x, hdr, sel, bw, rate);
+        std::cout << "Low delay: algorithmic delay " << wofl::algorithmic_delay(hdr) << " samples ("
+                  << wofl::algorithmic_delay_ms(hdr) << " ms)" << std::endl;
+        if (wofl::algorithmic_delay_ms(hdr) > wofl::LOW_DELAY_TARGET_MS)
+            std::cerr << "warning: the algorithmic delay is over the " << wofl::LOW_DELAY_TARGET_MS
+                      << " ms target; use a smaller --hop" << std::endl;
+    } else if (live) {
+        // pipelined encoder, fed from the file as from a capture device,
+        // through the resampler when the rate changes
+        std::unique_ptr<wofl::ResampledReader> rs;
+        if (sr != in_sr)
+            rs = std::make_unique<wofl::ResampledReader>(ch, in_sr, sr,
+                                                         [&](float* d, size_t f) { return wav.read(d, f); });
+        wofl::SampleSource source = [&](float* dst, size_t n) {
+            size_t m = rs ? rs->pull(dst, n) : wav.read(dst, n / ch) * ch;
+            level.add(dst, m);
+            nsamp += m / ch;
+            return m;
+        };
+        wofl::LiveStats st = wofl::encode_live(source, hdr, sel, bw, 8, rate);
+        hdr.peak_ref = level.peak;
+        hdr.rms_ref = level.rms();
+        wofl::BitWriter head;
+        hdr.write(head);
+        bw.patch_bytes(0, head.bytes());
+        std::cout << "Live frames=" << st.frames
+                  << " latency mean=" << st.mean_latency_us << "us"
+                  << " max=" << st.max_latency_us << "us" << std::endl;
+    } else {
+        // analysis + parametric/residual encoding
+        wofl::encode_stream(x, hdr, sel, bw, seg_frames, rate, threads);
+    }
 
    bw.save(outpath);
 
-    std::cout << "Bytes written: " << bw.bytes_written() << std::endl;
+    std::cout << "Bytes written: " << bw.bytes_written()
+              << " (" << bw.bytes_written() * 8.0 * sr / (1000.0 * std::max<size_t>(nsamp, 1))
+              << " kbit/s)" << std::endl;
     return 0;
 }
@@ -0,0 +1,77 @@
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "wav.hpp"
+#include "lowdelay.hpp"
+
+// Latency harness for the low-delay profile: runs a file through the
+// push/pull encoder and decoder one frame at a time and reports the
+// algorithmic delay plus the per-frame processing time.
+int main(int argc, char** argv) {
+    std::vector<std::string> paths;
+    size_t hop = 0; // 0 = low_delay_hop of the file's rate
+    wofl::TrackSelect sel;
+    float step = 0.004f;
+    wofl::RateParams rate;
+    std::string csv;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--",0)!=0) paths.push_back(arg);
+        if (arg.rfind("--hop=",0)==0) hop = std::stoul(arg.substr(6));
+        if (arg.rfind("--K=",0)==0) sel.K = std::stoi(arg.substr(4));
+        if (arg.rfind("--step=",0)==0) step = std::stof(arg.substr(7));
+        if (arg.rfind("--cbr=",0)==0) rate = {wofl::RateMode::CBR, std::stod(arg.substr(6))};
+        if (arg.rfind("--abr=",0)==0) rate = {wofl::RateMode::ABR, std::stod(arg.substr(6))};
+        if (arg.rfind("--csv=",0)==0) csv = arg.substr(6);
+    }
+
+    if (paths.empty()) {
+        std::cerr << "Usage: latency <input.wav> [output.wav] [--hop=H] [--K=K] [--step=S] [--cbr=KBPS|--abr=KBPS] [--csv=FILE]" << std::endl;
+        return 1;
+    }
+    if (hop && (hop < 2 || (hop & (hop - 1)))) {
+        std::cerr << "hop must be a power of two" << std::endl;
+        return 1;
+    }
+
+    wofl::WavData w = wofl::read_wav(paths[0]);
+    wofl::StreamHeader hdr;
+    hdr.sr = (uint32_t)w.sample_rate;
+    hdr.ch = (uint32_t)w.channels;
+    hdr.step = step;
+    wofl::low_delay_profile(hdr, hop);
+    hop = hdr.hop;
+    hdr.channel_mask = w.channel_mask;
+    hdr.pcm = w.format;
+    hdr.elements = hdr.channel_elements();
+
+    std::ofstream log;
+    if (!csv.empty()) {
+        log.open(csv);
+        log << "frame,encode_us,decode_us\n";
+    }
+    std::vector<float> out;
+    wofl::LatencyStats st = wofl::measure_low_delay(w.samples, hdr, sel, out, rate,
+                                                    [&](size_t f, double eu, double du) {
+                                                        if (log) log << f << ',' << eu << ',' << du << '\n';
+                                                    });
+
+    const double frame_ms = 1000.0 * double(hop) / double(w.sample_rate);
+    std::cout << "Frames=" << st.frames << " hop=" << hop << " (" << frame_ms << " ms)"
+              << " nfft=" << hdr.nfft << std::endl;
+    std::cout << "Algorithmic delay=" << st.algorithmic_ms << " ms" << std::endl;
+    if (st.algorithmic_ms > wofl::LOW_DELAY_TARGET_MS)
+        std::cerr << "warning: the algorithmic delay alone is over the " << wofl::LOW_DELAY_TARGET_MS
+                  << " ms target; use a smaller --hop" << std::endl;
+    std::cout << "Processing per frame: encode mean=" << st.mean_encode_us << "us max=" << st.max_encode_us
+              << "us, decode mean=" << st.mean_decode_us << "us max=" << st.max_decode_us << "us" << std::endl;
+    std::cout << "End-to-end worst case=" << st.algorithmic_ms + st.max_frame_us / 1000.0 << " ms" << std::endl;
+    std::cout << "Frames over " << wofl::LOW_DELAY_TARGET_MS << " ms=" << st.late << std::endl;
+    std::cout << "Payload=" << st.bytes * 8.0 * w.sample_rate / (1000.0 * std::max<size_t>(st.frames, 1) * hop)
+              << " kbit/s" << std::endl;
+
+    if (paths.size() > 1) wofl::write_wav(paths[1], out, w.sample_rate, w.channels, w.channel_mask, w.format);
+    return 0;
+}
@@ -0,0 +1,27 @@
+#include <iostream>
+#include <string>
+#include <vector>
+#include "bitstream.hpp"
+
+// Drops the residual (enhancement) layer from a hybrid stream without
+// re-encoding; the output decodes from its sinusoidal tracks alone.
+int main(int argc, char** argv) {
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg.rfind("--",0)!=0) paths.push_back(arg);
+    }
+
+    if (paths.size() < 2) {
+        std::cerr << "Usage: layerstrip <input.bin> <output.bin>" << std::endl;
+        return 1;
+    }
+
+    wofl::BitReader br(paths[0]);
+    wofl::BitWriter bw;
+    wofl::strip_enhancement(br, bw);
+    bw.save(paths[1]);
+
+    std::cout << "Bytes written: " << bw.bytes_written() << std::endl;
+    return 0;
+}
@@ -0,0 +1,93 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <cmath>
+#include <algorithm>
+
+namespace wofl {
+
+// Peak and RMS of everything added, over all channels.
+struct LevelMeter {
+    float peak = 0.0f;
+    double energy = 0.0;
+    size_t count = 0;
+
+    void add(const float *x, size_t n) {
+        double e = 0.0;
+        for (size_t i = 0; i < n; ++i) {
+            peak = std::max(peak, std::fabs(x[i]));
+            e += double(x[i]) * x[i];
+        }
+        energy += e;
+        count += n;
+    }
+
+    float rms() const { return count ? float(std::sqrt(energy / double(count))) : 0.0f; }
+};
+
+// Streaming look-ahead peak limiter over interleaved frames, one gain for
+// all channels so the image does not shift. The gain a frame needs to stay
+// under the ceiling is held for L frames (a sliding minimum) and smoothed
+// by an L-frame moving average; with the audio delayed by L - 1 frames
+// every output frame then gets at most the gain it needs, and the gain
+// ramps down over L frames instead of stepping. Recovery follows an
+// exponential release.
+class PeakLimiter {
+    size_t ch, L;
+    float ceiling, release;
+    std::vector<float> delay;   // ring of L frames of input
+    std::vector<float> held;    // ring of the last L held gains
+    std::deque<std::pair<size_t, float>> minq; // (frame, needed gain), increasing gains
+    double sum = 0.0;           // of held
+    float g = 1.0f;
+    size_t t = 0;               // frames pushed
+
+public:
+    PeakLimiter(int channels, int sample_rate, float ceiling_ = 0.999f, float lookahead_ms = 1.5f,
+                float release_ms = 80.0f)
+        : ch(size_t(channels)),
+          L(std::max<size_t>(1, size_t(std::lround(lookahead_ms * 1e-3f * float(sample_rate))))),
+          ceiling(ceiling_),
+          release(1.0f - std::exp(-1.0f / (release_ms * 1e-3f * float(sample_rate)))),
+          delay(L * ch, 0.0f), held(L, 1.0f), sum(double(L)) {}
+
+    // frames of output behind the input
+    size_t latency() const { return L - 1; }
+
+    // n frames from in; writes the frames that come out (n less the ones
+    // still in the delay line at the start) to out and returns how many.
+    // out may be in: frame j is written only after frame i >= j is read.
+    size_t process(const float *in, size_t n, float *out) {
+        size_t m = 0;
+        for (size_t i = 0; i < n; ++i, ++t) {
+            const float *x = in ? in + i * ch : nullptr;
+            float peak = 0.0f;
+            if (x) for (size_t c = 0; c < ch; ++c) peak = std::max(peak, std::fabs(x[c]));
+            float need = peak > ceiling ? ceiling / peak : 1.0f;
+
+            while (!minq.empty() && minq.back().second >= need) minq.pop_back();
+            minq.emplace_back(t, need);
+            if (minq.front().first + L <= t) minq.pop_front();
+            float h = minq.front().second;
+            sum += double(h) - double(held[t % L]);
+            held[t % L] = h;
+            float target = float(sum / double(L));
+            g = target < g ? target : g + (target - g) * release;
+
+            // out frame t - (L - 1) leaves the ring where frame t goes in
+            float *slot = delay.data() + (t % L) * ch;
+            float *tail = delay.data() + ((t + 1) % L) * ch; // oldest frame
+            for (size_t c = 0; c < ch; ++c) slot[c] = x ? x[c] : 0.0f;
+            if (t + 1 >= L) {
+                for (size_t c = 0; c < ch; ++c) out[m * ch + c] = tail[c] * g;
+                ++m;
+            }
+        }
+        return m;
+    }
+
+    // the latency() frames still held, pushed out by silence
+    size_t flush(float *out) { return process(nullptr, latency(), out); }
+};
+
+} // namespace wofl
@@ -0,0 +1,387 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
+#include "bitio.hpp"
+#include "rice.hpp"
+#include "channels.hpp"
+
+namespace wofl {
+
+// Lossless coding of integer PCM, block by block: each channel of a block
+// is predicted by a quantized LPC filter (Levinson-Durbin on the block's
+// windowed autocorrelation) and the integer prediction residual is sent in
+// partitioned Rice codes, each partition with its own k. Stereo pairs may
+// be coded as left/side, right/side or mid/side.
+
+// samples per block and channel (the last block of a segment may be short)
+constexpr size_t LOSSLESS_BLOCK = 4096;
+// higher orders rarely pay for their coefficients on blocks this size
+constexpr int LPC_MAX_ORDER = 12;
+constexpr int LPC_ORDER_BITS = 4;
+static_assert(LPC_MAX_ORDER < (1 << LPC_ORDER_BITS), "order field too narrow");
+// quantized coefficients are signed LPC_PRECISION-bit integers scaled by
+// 2^shift, shift in [0, LPC_MAX_SHIFT]
+constexpr int LPC_PRECISION = 15;
+constexpr int LPC_MAX_SHIFT = 15;
+// the order search keeps at least this many samples per coefficient
+constexpr size_t LPC_SAMPLES_PER_ORDER = 4;
+// residual partitions: up to 2^RICE_MAX_PARTITION_ORDER per block, each
+// with a RICE_PARAM_BITS-bit k
+constexpr int RICE_MAX_PARTITION_ORDER = 8;
+constexpr int RICE_PARAM_BITS = 5;
+// Rice parameter of constant-block values
+constexpr uint32_t LOSSLESS_VALUE_K = 16;
+
+// how a channel pair's block is coded
+enum : uint32_t {
+    STEREO_LR = 0,
+    STEREO_LS = 1, // left, left - right
+    STEREO_RS = 2, // right, left - right
+    STEREO_MS = 3, // (left + right) >> 1, left - right
+};
+
+struct QuantLpc {
+    int order = 0;
+    int shift = 0;
+    int32_t rev[LPC_MAX_ORDER] = {}; // coefficients, oldest sample first
+};
+
+// Prediction of x[n] from past = x + n - order: a dot product over two
+// contiguous arrays, which the compiler turns into vector multiply-adds.
+// Encoder and decoder share the kernels, so predictions match bit for bit.
+inline int32_t lpc_predict64(const int32_t *past, const QuantLpc &q) {
+    int64_t acc = 0;
+    for (int j = 0; j < q.order; ++j) acc += int64_t(q.rev[j]) * past[j];
+    return int32_t(acc >> q.shift);
+}
+
+// Same, for predictors whose sum cannot leave 32 bits (lpc_fits_32): four
+// lanes per SSE register instead of two. Wrapping unsigned arithmetic keeps
+// a corrupt stream from overflowing a signed accumulator.
+inline int32_t lpc_predict32(const int32_t *past, const QuantLpc &q) {
+    uint32_t acc = 0;
+    for (int j = 0; j < q.order; ++j) acc += uint32_t(q.rev[j]) * uint32_t(past[j]);
+    return int32_t(acc) >> q.shift;
+}
+
+// whether predictions from samples of at most `bits` bits (sign included)
+// fit a 32-bit accumulator
+inline bool lpc_fits_32(const QuantLpc &q, int bits) {
+    int64_t sum = 0;
+    for (int j = 0; j < q.order; ++j) sum += std::abs(q.rev[j]);
+    return (sum << (bits - 1)) < (int64_t(1) << 31);
+}
+
+inline void lpc_residual(const int32_t *x, size_t n, const QuantLpc &q, int bits, int32_t *res) {
+    if (lpc_fits_32(q, bits))
+        for (size_t i = q.order; i < n; ++i) res[i] = x[i] - lpc_predict32(x + i - q.order, q);
+    else
+        for (size_t i = q.order; i < n; ++i) res[i] = x[i] - lpc_predict64(x + i - q.order, q);
+}
+
+// inverse of lpc_residual; x[0, order) already holds the warm-up samples
+inline void lpc_restore(int32_t *x, size_t n, const QuantLpc &q, int bits, const int32_t *res) {
+    if (lpc_fits_32(q, bits))
+        for (size_t i = q.order; i < n; ++i) x[i] = res[i] + lpc_predict32(x + i - q.order, q);
+    else
+        for (size_t i = q.order; i < n; ++i) x[i] = res[i] + lpc_predict64(x + i - q.order, q);
+}
+
+// autocorrelation r[0..maxlag] of x under a Welch window
+inline void windowed_autocorr(const int32_t *x, size_t n, int maxlag, std::vector<double> &w,
+                              std::vector<double> &r) {
+    w.resize(n);
+    const double scale = 2.0 / double(n + 1), mid = 0.5 * double(n - 1);
+    for (size_t i = 0; i < n; ++i) {
+        double t = (double(i) - mid) * scale;
+        w[i] = double(x[i]) * (1.0 - t * t);
+    }
+    r.assign(maxlag + 1, 0.0);
+    for (int lag = 0; lag <= maxlag; ++lag) {
+        // eight independent partial sums, so the loop vectorises without
+        // reassociating floating-point adds
+        double p[8] = {};
+        size_t i = lag;
+        for (; i + 8 <= n; i += 8)
+            for (int t = 0; t < 8; ++t) p[t] += w[i + t] * w[i + t - lag];
+        double s = ((p[0] + p[1]) + (p[2] + p[3])) + ((p[4] + p[5]) + (p[6] + p[7]));
+        for (; i < n; ++i) s += w[i] * w[i - lag];
+        r[lag] = s;
+    }
+}
+
+// Levinson-Durbin recursion up to maxorder. Row o-1 of a (maxorder wide)
+// holds the order-o predictor, x[n] ~ sum_j a[j] x[n-1-j], and err[o] its
+// prediction error. Returns the highest order reached before the error
+// vanished.
+inline int levinson(const std::vector<double> &r, int maxorder, std::vector<double> &a,
+                    std::vector<double> &err, std::vector<double> &tmp) {
+    a.assign(size_t(maxorder) * maxorder, 0.0);
+    err.assign(maxorder + 1, 0.0);
+    tmp.assign(maxorder, 0.0);
+    err[0] = r[0];
+    if (r[0] <= 0.0) return 0;
+    std::vector<double> cur(maxorder, 0.0);
+    for (int o = 1; o <= maxorder; ++o) {
+        double acc = r[o];
+        for (int j = 0; j < o - 1; ++j) acc -= cur[j] * r[o - 1 - j];
+        double k = acc / err[o - 1];
+        std::copy(cur.begin(), cur.begin() + o - 1, tmp.begin());
+        for (int j = 0; j < o - 1; ++j) cur[j] = tmp[j] - k * tmp[o - 2 - j];
+        cur[o - 1] = k;
+        err[o] = err[o - 1] * (1.0 - k * k);
+        std::copy(cur.begin(), cur.begin() + o, a.begin() + size_t(o - 1) * maxorder);
+        if (err[o] <= 0.0) return o;
+    }
+    return maxorder;
+}
+
+// quantize an order-n predictor, carrying each coefficient's rounding
+// error into the next
+inline void quantize_lpc(const double *a, int order, QuantLpc &q) {
+    q.order = order;
+    double cmax = 0.0;
+    for (int j = 0; j < order; ++j) cmax = std::max(cmax, std::fabs(a[j]));
+    int e = 0;
+    std::frexp(cmax, &e); // cmax < 2^e
+    q.shift = std::min(LPC_MAX_SHIFT, std::max(0, LPC_PRECISION - 1 - e));
+    const double lim = double((1 << (LPC_PRECISION - 1)) - 1);
+    double carry = 0.0;
+    for (int j = 0; j < order; ++j) {
+        double v = a[j] * double(1 << q.shift) + carry;
+        double c = std::min(lim, std::max(-lim, std::round(v)));
+        carry = v - c;
+        q.rev[order - 1 - j] = int32_t(c);
+    }
+}
+
+// Best Rice parameter for n values summing to sum, with the bit count
+// (sum >> k stands in for the exact sum of quotients).
+inline uint32_t rice_param(uint64_t sum, size_t n, uint64_t &bits) {
+    uint32_t k = 0;
+    bits = n + sum;
+    while (k + 1 < (1u << RICE_PARAM_BITS) - 1) {
+        uint64_t b = uint64_t(n) * (k + 2) + (sum >> (k + 1));
+        if (b >= bits) break;
+        bits = b;
+        ++k;
+    }
+    return k;
+}
+
+// Per-thread work buffers of the block coder.
+struct LosslessScratch {
+    std::vector<double> w, r, a, err, tmp;
+    std::vector<int32_t> res, side, mid;
+    std::vector<uint32_t> u;
+    std::vector<uint64_t> sums;
+};
+
+// Partition order and estimated bits of m residuals zigzagged into u: the
+// partition sums are built once at the finest order and merged pairwise.
+inline int rice_partition_order(const uint32_t *u, size_t m, std::vector<uint64_t> &sums, uint64_t &best_bits) {
+    int pmax = 0;
+    while (pmax < RICE_MAX_PARTITION_ORDER && (size_t(2) << pmax) <= m) ++pmax;
+    sums.assign(size_t(1) << pmax, 0);
+    for (size_t i = 0; i < sums.size(); ++i) {
+        size_t lo = (i * m) >> pmax, hi = ((i + 1) * m) >> pmax;
+        uint64_t s = 0;
+        for (size_t t = lo; t < hi; ++t) s += u[t];
+        sums[i] = s;
+    }
+    int best = pmax;
+    best_bits = ~uint64_t(0);
+    for (int p = pmax;; --p) {
+        uint64_t bits = 0, b;
+        size_t parts = size_t(1) << p;
+        for (size_t i = 0; i < parts; ++i) {
+            size_t lo = (i * m) >> p, hi = ((i + 1) * m) >> p;
+            rice_param(sums[i], hi - lo, b);
+            bits += RICE_PARAM_BITS + b;
+        }
+        if (bits < best_bits) { best_bits = bits; best = p; }
+        if (p == 0) break;
+        for (size_t i = 0; i < parts / 2; ++i) sums[i] = sums[2 * i] + sums[2 * i + 1];
+    }
+    return best;
+}
+
+// estimated bits of the residuals res[0, m)
+inline uint64_t residual_cost(const int32_t *res, size_t m, LosslessScratch &s) {
+    s.u.resize(m);
+    for (size_t i = 0; i < m; ++i) s.u[i] = zigzag(res[i]);
+    uint64_t bits = 0;
+    rice_partition_order(s.u.data(), m, s.sums, bits);
+    return bits;
+}
+
+inline void write_residual(BitWriter &bw, const int32_t *res, size_t m, LosslessScratch &s) {
+    s.u.resize(m);
+    for (size_t i = 0; i < m; ++i) s.u[i] = zigzag(res[i]);
+    uint64_t bits = 0;
+    int p = rice_partition_order(s.u.data(), m, s.sums, bits);
+    bw.put_bits(uint32_t(p), 4);
+    for (size_t i = 0; i < (size_t(1) << p); ++i) {
+        size_t lo = (i * m) >> p, hi = ((i + 1) * m) >> p;
+        uint64_t sum = 0, b;
+        for (size_t t = lo; t < hi; ++t) sum += s.u[t];
+        uint32_t k = rice_param(sum, hi - lo, b);
+        bw.put_bits(k, RICE_PARAM_BITS);
+        for (size_t t = lo; t < hi; ++t) Rice::write_uint(bw, s.u[t], k);
+    }
+}
+
+inline void read_residual(BitReader &br, int32_t *res, size_t m) {
+    int p = (int)br.get_bits(4);
+    if (p > RICE_MAX_PARTITION_ORDER || (p > 0 && (size_t(1) << p) > m))
+        throw std::runtime_error("bad lossless partition order");
+    for (size_t i = 0; i < (size_t(1) << p); ++i) {
+        size_t lo = (i * m) >> p, hi = ((i + 1) * m) >> p;
+        uint32_t k = br.get_bits(RICE_PARAM_BITS);
+        for (size_t t = lo; t < hi; ++t) res[t] = unzigzag(Rice::read_uint(br, k));
+    }
+}
+
+// One channel of a block: a constant block is sent as its value, anything
+// else as an LPC predictor (order 0 sends the samples themselves), its
+// warm-up samples and the residual. The order minimising the Levinson
+// error estimate plus coefficient bits is tried against order 0. Samples
+// have at most `bits` bits, sign included.
+inline void write_subframe(BitWriter &bw, const int32_t *x, size_t n, int bits, LosslessScratch &s) {
+    if (std::all_of(x, x + n, [&](int32_t v) { return v == x[0]; })) {
+        bw.put_bit(0);
+        Rice::write_sint(bw, x[0], LOSSLESS_VALUE_K);
+        return;
+    }
+    bw.put_bit(1);
+    int maxorder = (int)std::min<size_t>(LPC_MAX_ORDER, n / LPC_SAMPLES_PER_ORDER);
+    QuantLpc q;
+    if (maxorder > 0) {
+        windowed_autocorr(x, n, maxorder, s.w, s.r);
+        int reached = levinson(s.r, maxorder, s.a, s.err, s.tmp);
+        int best = 0;
+        double best_bits = 0.0;
+        for (int o = 1; o <= reached; ++o) {
+            double bits = 0.5 * double(n) * std::log2(std::max(s.err[o], 1e-9) / s.err[0]) + o * LPC_PRECISION;
+            if (bits < best_bits) { best_bits = bits; best = o; }
+        }
+        if (best > 0) quantize_lpc(s.a.data() + size_t(best - 1) * maxorder, best, q);
+    }
+    s.res.resize(n);
+    if (q.order > 0) {
+        lpc_residual(x, n, q, bits, s.res.data());
+        uint64_t lpc_bits = residual_cost(s.res.data() + q.order, n - q.order, s) +
+                            uint64_t(q.order) * (LPC_PRECISION + 8);
+        if (lpc_bits >= residual_cost(x, n, s)) q.order = 0;
+    }
+    if (q.order == 0) std::copy(x, x + n, s.res.begin());
+
+    bw.put_bits(uint32_t(q.order), LPC_ORDER_BITS);
+    if (q.order > 0) {
+        bw.put_bits(uint32_t(q.shift), 4);
+        for (int j = 0; j < q.order; ++j) bw.put_bits(uint32_t(q.rev[j]), LPC_PRECISION);
+        uint64_t sum = 0, b;
+        for (int j = 0; j < q.order; ++j) sum += zigzag(x[j]);
+        uint32_t k = rice_param(sum, q.order, b);
+        bw.put_bits(k, RICE_PARAM_BITS);
+        for (int j = 0; j < q.order; ++j) Rice::write_sint(bw, x[j], k);
+    }
+    write_residual(bw, s.res.data() + q.order, n - q.order, s);
+}
+
+inline void read_subframe(BitReader &br, int32_t *x, size_t n, int bits, std::vector<int32_t> &res) {
+    if (!br.get_bit()) {
+        std::fill(x, x + n, Rice::read_sint(br, LOSSLESS_VALUE_K));
+        return;
+    }
+    QuantLpc q;
+    q.order = (int)br.get_bits(LPC_ORDER_BITS);
+    if (q.order > LPC_MAX_ORDER || size_t(q.order) > n) throw std::runtime_error("bad lossless predictor order");
+    if (q.order > 0) {
+        q.shift = (int)br.get_bits(4);
+        for (int j = 0; j < q.order; ++j) {
+            uint32_t v = br.get_bits(LPC_PRECISION);
+            q.rev[j] = int32_t(v << (32 - LPC_PRECISION)) >> (32 - LPC_PRECISION); // sign-extend
+        }
+        uint32_t k = br.get_bits(RICE_PARAM_BITS);
+        for (int j = 0; j < q.order; ++j) x[j] = Rice::read_sint(br, k);
+    }
+    res.resize(n);
+    read_residual(br, res.data() + q.order, n - q.order);
+    if (q.order == 0) std::copy(res.begin(), res.end(), x);
+    else lpc_restore(x, n, q, bits, res.data());
+}
+
+// sum of |second difference|, a cheap stand-in for a channel's coded size
+inline uint64_t roughness(const int32_t *x, size_t n) {
+    uint64_t s = 0;
+    for (size_t i = 2; i < n; ++i) s += (uint64_t)std::llabs(int64_t(x[i]) - 2 * int64_t(x[i - 1]) + x[i - 2]);
+    return s;
+}
+
+// One block of n samples per channel in blk, of `bits`-bit PCM. Each pair
+// sends its stereo mode in two bits, then the element's channels follow;
+// a side channel has one bit more than the input.
+inline void write_lossless_block(BitWriter &bw, const std::vector<ChannelElement> &el,
+                                 const std::vector<std::vector<int32_t>> &blk, size_t n, int bits,
+                                 LosslessScratch &s) {
+    for (const auto &e : el) {
+        if (!e.pair()) {
+            write_subframe(bw, blk[e.a].data(), n, bits, s);
+            continue;
+        }
+        const int32_t *l = blk[e.a].data(), *r = blk[e.b].data();
+        s.side.resize(n);
+        s.mid.resize(n);
+        for (size_t i = 0; i < n; ++i) {
+            s.side[i] = l[i] - r[i];
+            s.mid[i] = (l[i] + r[i]) >> 1;
+        }
+        uint64_t cl = roughness(l, n), cr = roughness(r, n), cs = roughness(s.side.data(), n),
+                 cm = roughness(s.mid.data(), n);
+        uint64_t cost[4] = {cl + cr, cl + cs, cr + cs, cm + cs};
+        uint32_t mode = uint32_t(std::min_element(cost, cost + 4) - cost);
+        bw.put_bits(mode, 2);
+        const int32_t *first = mode == STEREO_RS ? r : mode == STEREO_MS ? s.mid.data() : l;
+        const int32_t *second = mode == STEREO_LR ? r : s.side.data();
+        // write_subframe uses s.res and s.u only, so the mid/side buffers survive
+        write_subframe(bw, first, n, bits, s);
+        write_subframe(bw, second, n, mode == STEREO_LR ? bits : bits + 1, s);
+    }
+}
+
+inline void read_lossless_block(BitReader &br, const std::vector<ChannelElement> &el,
+                                std::vector<std::vector<int32_t>> &blk, size_t n, int bits,
+                                std::vector<int32_t> &res) {
+    for (const auto &e : el) {
+        if (!e.pair()) {
+            read_subframe(br, blk[e.a].data(), n, bits, res);
+            continue;
+        }
+        uint32_t mode = br.get_bits(2);
+        int32_t *a = blk[e.a].data(), *b = blk[e.b].data();
+        read_subframe(br, a, n, bits, res);
+        read_subframe(br, b, n, mode == STEREO_LR ? bits : bits + 1, res);
+        // a holds left, right or mid; b holds right or the side
+        for (size_t i = 0; i < n; ++i) {
+            int32_t x = a[i], side = b[i];
+            switch (mode) {
+            case STEREO_LS: b[i] = x - side; break;
+            case STEREO_RS: a[i] = x + side; b[i] = x; break;
+            case STEREO_MS: {
+                int32_t m = int32_t(uint32_t(x) << 1) | (side & 1);
+                a[i] = (m + side) >> 1;
+                b[i] = (m - side) >> 1;
+                break;
+            }
+            default: break;
+            }
+        }
+    }
+}
+
+} // namespace wofl
@@ -0,0 +1,241 @@
+#pragma once
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include "bitio.hpp"
+#include "bitstream.hpp"
+#include "channels.hpp"
+
+namespace wofl {
+
+// Low-delay profile for interactive links: short frames, nfft =
+// LOW_DELAY_OVERLAP*hop, frame-by-frame coding and unit-gain output with
+// no whole-file normalisation. The delay budget goes to overlap rather
+// than block length: at 75% each partial is measured in four frames and
+// the tracks' Hann synthesis windows still add back to a constant. A
+// hop-point MDCT is too coarse for the masking model, so the residual is
+// coded with one uniform step.
+//
+// This is a deliberate departure from one hop of look-ahead: the STFT
+// frame reaches three hops past the residual block, not one. On
+// data/input.wav at 44.1 kHz, nfft = 2*hop at hop 64 has 4.3 ms of
+// algorithmic delay against 7.2 ms here, but its base layer is 3 dB worse
+// (19.0 against 22.2 dB) at 49 kbit/s against 40. At hop 128 it is worse
+// still (15.0 dB) for 8.7 ms. For a given nfft, 75% overlap also has the
+// shorter delay.
+constexpr size_t LOW_DELAY_OVERLAP = 4;
+
+// end-to-end delay the profile is meant for; the harness counts the frames
+// whose algorithmic delay plus processing time go over it
+constexpr double LOW_DELAY_TARGET_MS = 10.0;
+
+// share of the target kept for processing when the hop is chosen; frames
+// take 15-80 us here, the rest is scheduler slack
+constexpr double LOW_DELAY_MARGIN_MS = 1.0;
+
+// the shortest hop low_delay_hop picks: nfft 32, 250 Hz bins at 8 kHz
+constexpr size_t LOW_DELAY_MIN_HOP = 8;
+
+// The largest power-of-two hop whose algorithmic delay at sr stays within
+// the target less the margin: 64 at 44.1 and 48 kHz, 16 at 16 kHz, 8 at
+// 8 kHz. Never under LOW_DELAY_MIN_HOP, so very low rates go over.
+inline size_t low_delay_hop(uint32_t sr) {
+    const double budget = (LOW_DELAY_TARGET_MS - LOW_DELAY_MARGIN_MS) * sr / 1000.0;
+    size_t hop = LOW_DELAY_MIN_HOP;
+    while (double((LOW_DELAY_OVERLAP + 1) * 2 * hop - 1) <= budget) hop *= 2;
+    return hop;
+}
+
+// hop and nfft of the profile, flagged in the header; clears STREAM_PSY.
+// hop 0 takes low_delay_hop of hdr.sr, so set the coded rate first.
+inline void low_delay_profile(StreamHeader &hdr, size_t hop = 0) {
+    if (!hop) hop = low_delay_hop(hdr.sr);
+    hdr.hop = (uint32_t)hop;
+    hdr.nfft = (uint32_t)(LOW_DELAY_OVERLAP * hop);
+    hdr.flags = (hdr.flags & ~uint32_t(STREAM_PSY)) | STREAM_LOW_DELAY;
+}
+
+// Worst-case samples between a sample entering the encoder and leaving the
+// decoder, processing aside: sample t in [(j-1)*hop, j*hop) is final after
+// frame j, whose block reaches input sample j*hop + nfft - 1.
+inline size_t algorithmic_delay(const StreamHeader &hdr) {
+    return hdr.nfft + hdr.hop - 1;
+}
+
+inline double algorithmic_delay_ms(const StreamHeader &hdr) {
+    return 1000.0 * double(algorithmic_delay(hdr)) / double(hdr.sr);
+}
+
+// One coded frame as it would travel on a link: its tracks (base layer)
+// and its residual (enhancement layer); bytes() of each is the payload.
+struct FramePacket {
+    BitWriter tracks;
+    BitWriter residual;
+};
+
+// Push/pull encoder: push one hop of input, then pull the frame it
+// completed before pushing the next. The first frame needs nfft samples,
+// so the first nfft/hop - 1 pushes yield nothing; after finish(), pull
+// returns the frames still owed, coded from zero input.
+class LowDelayEncoder {
+    FrameEncoder enc;
+    Planar window;       // block of the next frame, x[f*hop, f*hop+nfft)
+    size_t filled = 0;   // hops in window
+    size_t tail = 0;     // zero hops still to shift in after finish()
+    bool pending = false;
+
+    void shift_in(const float *pcm, size_t n) {
+        const size_t hop = enc.hdr.hop, ch = enc.hdr.ch;
+        for (size_t c = 0; c < ch; ++c) {
+            std::vector<float> &w = window[c];
+            std::copy(w.begin() + hop, w.end(), w.begin());
+            float *dst = w.data() + w.size() - hop;
+            for (size_t i = 0; i < n; ++i) dst[i] = pcm[i * ch + c];
+            std::fill(dst + n, dst + hop, 0.0f);
+        }
+        filled = std::min(filled + 1, window[0].size() / hop);
+        pending = filled == window[0].size() / hop;
+    }
+
+public:
+    LowDelayEncoder(const StreamHeader &hdr, const TrackSelect &sel, const RateParams &rate = {})
+        : enc(hdr, sel, rate), window(hdr.ch, std::vector<float>(hdr.nfft, 0.0f)) {}
+
+    // n <= hop interleaved samples per channel; a short hop is zero-padded
+    void push(const float *pcm, size_t n) {
+        shift_in(pcm, std::min<size_t>(n, enc.hdr.hop));
+    }
+
+    void finish() { tail = enc.hdr.nfft / enc.hdr.hop; }
+
+    bool pull(FramePacket &pkt) {
+        if (!pending && tail) {
+            shift_in(nullptr, 0);
+            --tail;
+        }
+        if (!pending) return false;
+        pending = false;
+        enc.encode(window, pkt.tracks, pkt.residual);
+        return true;
+    }
+};
+
+// Push/pull decoder: push a frame's packet, then pull the hop of
+// interleaved output it completed. The first frame only completes the
+// one-hop lead of the extended timeline, so nothing is pulled after it.
+class LowDelayDecoder {
+    FrameDecoder dec;
+    Planar out;
+    size_t frames = 0;
+    bool pending = false;
+
+public:
+    explicit LowDelayDecoder(const StreamHeader &hdr) : dec(hdr), out(hdr.ch, std::vector<float>(hdr.hop)) {}
+
+    void push(const FramePacket &pkt) {
+        BitReader base(pkt.tracks.bytes());
+        BitReader enh(pkt.residual.bytes());
+        dec.decode(base, enh, out, 0);
+        pending = frames++ > 0;
+    }
+
+    bool pull(std::vector<float> &pcm) {
+        if (!pending) return false;
+        pending = false;
+        interleave(out, pcm);
+        return true;
+    }
+};
+
+// Encode the planes x with the push/pull encoder into one segment, a hop
+// at a time interleaved as from a capture device; hdr must use the
+// low-delay profile and already be written to bw.
+inline void encode_low_delay(const Planar &x, const StreamHeader &hdr, const TrackSelect &sel,
+                             BitWriter &bw, const RateParams &rate = {}) {
+    const size_t ch = hdr.ch, hop = hdr.hop, nsamp = x[0].size();
+    LowDelayEncoder enc(hdr, sel, rate);
+    FramePacket pkt;
+    BitWriter base, enh;
+    std::vector<float> blk(hop * ch);
+    size_t frames = 0;
+    auto drain = [&] {
+        while (enc.pull(pkt)) {
+            base.append(pkt.tracks);
+            enh.append(pkt.residual);
+            ++frames;
+        }
+    };
+    for (size_t t = 0; t < nsamp; t += hop) {
+        const size_t n = std::min(hop, nsamp - t);
+        for (size_t i = 0; i < n; ++i)
+            for (size_t c = 0; c < ch; ++c) blk[i * ch + c] = x[c][t + i];
+        enc.push(blk.data(), n);
+        drain();
+    }
+    enc.finish();
+    drain();
+    write_single_segment(bw, nsamp, frames, hdr, base, enh);
+}
+
+// Per-frame timing of an encoder -> packet -> decoder loop.
+struct LatencyStats {
+    size_t frames = 0;
+    double algorithmic_ms = 0.0;
+    double mean_encode_us = 0.0, max_encode_us = 0.0;
+    double mean_decode_us = 0.0, max_decode_us = 0.0;
+    double max_frame_us = 0.0; // encode + decode of the slowest frame
+    size_t late = 0;           // frames over LOW_DELAY_TARGET_MS end to end
+    size_t bytes = 0;          // packet payload, both layers
+};
+
+// Run interleaved pcm through the push/pull encoder and decoder frame by
+// frame, timing each side per frame; out receives the decoded pcm (unit
+// gain, nsamp samples per channel) and on_frame(frame, encode_us,
+// decode_us) is called for every frame.
+template <typename FrameFn>
+inline LatencyStats measure_low_delay(const std::vector<float> &pcm, const StreamHeader &hdr, const TrackSelect &sel,
+                                      std::vector<float> &out, const RateParams &rate, FrameFn on_frame) {
+    using clock = std::chrono::steady_clock;
+    const size_t ch = hdr.ch, hop = hdr.hop, nsamp = pcm.size() / ch;
+    LowDelayEncoder enc(hdr, sel, rate);
+    LowDelayDecoder dec(hdr);
+    FramePacket pkt;
+    std::vector<float> block;
+    LatencyStats st;
+    st.algorithmic_ms = algorithmic_delay_ms(hdr);
+    out.clear();
+    out.reserve(pcm.size() + hop * ch);
+    // push one hop (none when in is null) and pass on the frame it yields
+    auto step = [&](const float *in, size_t n) {
+        auto t0 = clock::now();
+        if (in) enc.push(in, n);
+        bool coded = enc.pull(pkt);
+        auto t1 = clock::now();
+        if (!coded) return false;
+        dec.push(pkt);
+        if (dec.pull(block)) out.insert(out.end(), block.begin(), block.end());
+        auto t2 = clock::now();
+        double eu = std::chrono::duration<double, std::micro>(t1 - t0).count();
+        double du = std::chrono::duration<double, std::micro>(t2 - t1).count();
+        st.mean_encode_us += eu;
+        st.mean_decode_us += du;
+        st.max_encode_us = std::max(st.max_encode_us, eu);
+        st.max_decode_us = std::max(st.max_decode_us, du);
+        st.max_frame_us = std::max(st.max_frame_us, eu + du);
+        st.late += st.algorithmic_ms + (eu + du) / 1000.0 > LOW_DELAY_TARGET_MS;
+        st.bytes += pkt.tracks.bytes().size() + pkt.residual.bytes().size();
+        on_frame(st.frames++, eu, du);
+        return true;
+    };
+    for (size_t t = 0; t < nsamp; t += hop) step(pcm.data() + t * ch, std::min(hop, nsamp - t));
+    enc.finish();
+    while (step(nullptr, 0)) {}
+    if (st.frames) {
+        st.mean_encode_us /= double(st.frames);
+        st.mean_decode_us /= double(st.frames);
+    }
+    out.resize(pcm.size(), 0.0f);
+    return st;
+}
+
+} // namespace wofl
@@ -8,62 +8,66 @@
 
 namespace wofl {
 
-// Fast MDCT/IMDCT using FFT radix-2
+// Fast MDCT/IMDCT: fold 2N windowed samples to N, then a DCT-IV computed
+// with an N/2-point complex FFT. Orthonormal scaling, so sine-windowed
+// blocks at hop N overlap-add back to the input exactly.
+// Holds scratch buffers: use one instance per thread.
 struct MDCT {
     size_t N;
     std::vector<float> win;
+    std::vector<cpx> pre, post;     // DCT-IV twiddles
+    mutable std::vector<float> fold;
+    mutable std::vector<cpx> work;
 
-    MDCT(size_t N_) : N(N_), win(2*N_) {
-        assert(N && (N & (N-1)) == 0);
+    MDCT(size_t N_) : N(N_), win(2*N_), pre(N_/2), post(N_/2), fold(N_), work(N_/2) {
+        assert(N >= 2 && (N & (N-1)) == 0);
         // Sine window (same as AAC-type IV window)
         for (size_t n=0; n<2*N; ++n) {
             win[n] = std::sin(float(wofl::PI)/(2.0f*N) * (n + 0.5f));
         }
+        for (size_t n=0; n<N/2; ++n) {
+            pre[n]  = std::polar(1.0f, -float(wofl::PI) * (4.0f*n + 1.0f) / (4.0f*N));
+            post[n] = std::polar(1.0f, -float(wofl::PI) * float(n) / float(N));
+        }
     }
 
-    // Forward MDCT (slow reference, could be optimized similarly if needed)
-    void forward(const std::vector<float>& x, size_t pos, std::vector<float>& X) const {
-        X.assign(N, 0.0f);
-        std::vector<std::complex<float>> temp(2*N);
-
-        for (size_t n=0; n<2*N; ++n) {
-            float sample = (pos+n < x.size()) ? x[pos+n] : 0.0f;
-            temp[n] = std::complex<float>(sample * win[n], 0.0f);
+    // in-place orthonormal DCT-IV of fold (length N)
+    void dct4() const {
+        const size_t h = N/2;
+        for (size_t n=0; n<h; ++n) work[n] = cpx(fold[2*n], fold[N-1-2*n]) * pre[n];
+        fft_radix2(work, false);
+        const float scale = std::sqrt(2.0f / float(N));
+        for (size_t k=0; k<h; ++k) {
+            cpx c = work[k] * post[k];
+            fold[2*k]       =  c.real() * scale;
+            fold[N-1-2*k]   = -c.imag() * scale;
         }
+    }
 
-        fft_radix2(temp, false);
-
-        // Take real part with pre-twiddle
-        for (size_t k=0; k<N; ++k) {
-            float re = temp[k].real();
-            float im = temp[k].imag();
-            float angle = float(wofl::PI)/N * (k + 0.5f + N/2.0f);
-            X[k] = re*std::cos(angle) + im*std::sin(angle);
-        }
+    // Forward MDCT of x[pos, pos+2N) (zero beyond the end of x)
+    void forward(const std::vector<float>& x, size_t pos, std::vector<float>& X) const {
+        auto z = [&](size_t n) { return (pos+n < x.size()) ? x[pos+n] * win[n] : 0.0f; };
+        const size_t h = N/2;
+        for (size_t n=0; n<h; ++n)   fold[n] = -z(3*h - 1 - n) - z(3*h + n);
+        for (size_t n=h; n<N; ++n)   fold[n] =  z(n - h) - z(3*h - 1 - n);
+        dct4();
+        X.assign(fold.begin(), fold.end());
     }
 
-    // Inverse MDCT (fast)
+    // Inverse MDCT, windowed and overlap-added into y[pos, pos+2N)
     void inverse(const std::vector<float>& X, std::vector<float>& y, size_t pos) const {
-        size_t n2 = 2*N;
-        std::vector<std::complex<float>> temp(n2);
-
-        // Pre-twiddle & build complex spectrum
-        for (size_t k=0; k<N; ++k) {
-            float angle = float(wofl::PI)/N * (k + 0.5f);
-            float xr = X[k] * std::cos(angle);
-            float xi = -X[k] * std::sin(angle);
-            temp[k]   = std::complex<float>(xr, xi);
-            temp[k+N] = std::complex<float>(-xr, xi); // symmetry
+        const size_t h = N/2;
+        for (size_t k=0; k<N; ++k) fold[k] = X[k];
+        dct4();
+        if (y.size() < pos+2*N) y.resize(pos+2*N, 0.0f);
+        float* out = y.data() + pos;
+        for (size_t n=0; n<h; ++n) {
+            out[3*h + n]     -= win[3*h + n] * fold[n];
+            out[3*h - 1 - n] -= win[3*h - 1 - n] * fold[n];
         }
-
-        // IFFT
-        fft_radix2(temp, true);
-
-        // Overlap-add with window
-        if (y.size() < pos+n2) y.resize(pos+n2, 0.0f);
-        for (size_t n=0; n<n2; ++n) {
-            float v = 2.0f/N * win[n] * temp[n].real();
-            y[pos+n] += v;
+        for (size_t n=h; n<N; ++n) {
+            out[n - h]       += win[n - h] * fold[n];
+            out[3*h - 1 - n] -= win[3*h - 1 - n] * fold[n];
         }
     }
 };
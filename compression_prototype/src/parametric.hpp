@@ -9,76 +9,244 @@
 #include "constants.hpp"
 #include <vector>
 #include <cmath>
+#include <algorithm>
 
 namespace wofl {
 
-struct TrackQ {
+// A partial carried from frame to frame: the decoder-side (quantized)
+// bin, log-magnitude index and phase, plus `dev`, how far its last phase
+// advance ran ahead of the bin-centre advance (the partial's frequency
+// offset within the bin, in radians per hop).
+struct Track {
     int bin;
     int qmag;
-    int qdphi; // quantized wrapped delta phase
+    float phase;
+    float dev = 0.0f;
 };
 
+// Phase quantization of the track layer, per track class: continuing
+// tracks send a residual against the predicted phase with `track_bits`
+// resolution, births send the phase itself with `birth_bits`. With
+// second_order the prediction adds the track's measured frequency offset.
+struct PhaseQ {
+    uint32_t track_bits = 5;
+    uint32_t birth_bits = 6;
+    bool second_order = true;
+};
+
+constexpr uint32_t PHASE_BITS_MIN = 2;
+constexpr uint32_t PHASE_BITS_MAX = 12;
+
+// Live tracks of one channel, sorted by bin. `advance` is the phase a
+// bin-centred sinusoid gains per bin per hop, 2*pi*hop/nfft.
 struct ParametricState {
-    std::vector<int> last_bin;
-    std::vector<float> last_phase;
+    std::vector<Track> tracks;
+    float advance = 0.0f;
+    PhaseQ pq;
+
+    ParametricState() = default;
+    ParametricState(size_t nfft, size_t hop, const PhaseQ &phase = {})
+        : advance(float(2.0*wofl::PI*double(hop)/double(nfft))), pq(phase) {}
+};
+
+// into [-pi, pi), so phases carried along a track stay small
+inline float wrap_phase(float p) {
+    const float twopi = float(2.0*wofl::PI);
+    return p - twopi*std::floor((p + float(wofl::PI))/twopi);
+}
+
+// Mid-tread phase quantizer with 2^bits levels over the circle; the index
+// is signed, in [-2^(bits-1), 2^(bits-1)).
+inline int quant_phase(float dphi, uint32_t bits) {
+    const int Q = 1 << bits;
+    int q = (int)std::lround(wrap_phase(dphi) * float(Q) / float(2.0*wofl::PI));
+    return q >= Q/2 ? q - Q : q;
+}
+
+inline float dequant_phase(int q, uint32_t bits) {
+    return float(q) * float(2.0*wofl::PI) / float(1 << bits);
+}
+
+// Phase advance of a track moving from t.bin to bin: the mean of the two
+// bin frequencies over one hop, plus pi per bin moved, since the analysis
+// window starts at the frame start rather than being centred and so a
+// partial's phase at bin k carries a pi*(f - k) term.
+inline float nominal_advance(const ParametricState& st, const Track& t, int bin) {
+    return st.advance*0.5f*float(t.bin + bin) + float(wofl::PI)*float(bin - t.bin);
+}
+
+// Phase a continuing track is predicted to have. Second order adds the
+// frequency offset measured on the track's last hop while it stays in the
+// same bin; a bin change re-centres the partial, so the offset is dropped.
+inline float predict_phase(const ParametricState& st, const Track& t, int bin) {
+    float adv = nominal_advance(st, t, bin);
+    if (st.pq.second_order && bin == t.bin) adv += t.dev;
+    return wrap_phase(t.phase + adv);
+}
+
+// the track after it continues to bin with decoded phase `phase`
+inline Track continue_track(const ParametricState& st, const Track& t, int bin, int qmag, float phase) {
+    return Track{bin, qmag, phase, wrap_phase(phase - t.phase - nominal_advance(st, t, bin))};
+}
+
+// The frequency of a track in fractional bins: its bin plus the offset
+// its last phase advance measured, at most half a bin either way.
+inline float track_freq(const ParametricState& st, const Track& t) {
+    return float(t.bin) + std::min(0.5f, std::max(-0.5f, t.dev / st.advance));
+}
+
+// Rice parameters for the track layer
+constexpr uint32_t TRACK_BIN_K = 0;    // bin change of a continuing track
+constexpr uint32_t TRACK_DMAG_K = 1;   // magnitude change of a continuing track
+constexpr uint32_t TRACK_BIRTHS_K = 3; // births per frame
+constexpr uint32_t TRACK_GAP_K = 4;    // bin gap between births
+constexpr uint32_t TRACK_MAG_K = 3;    // magnitude of a new track
+
+// Rice parameter for a continuing track's phase residual: predicted
+// phases mostly land within an eighth of a turn, which k = bits - 3 covers
+// with the shortest codes
+inline uint32_t phase_residual_k(const PhaseQ& pq) {
+    return pq.track_bits > 3 ? pq.track_bits - 3 : 0;
+}
+
+// A peak may continue a track at most this many bins away.
+constexpr int MAX_TRACK_JUMP = 3;
+
+// Peak-to-track assignment for one frame: peak[i] is the peak continuing
+// track i (-1 = the track dies), births the peaks starting new tracks in
+// ascending bin order.
+struct TrackMatch {
+    std::vector<int> peak;
+    std::vector<int> births;
 };
 
-inline int quant_phase(float dphi) {
-    const int Q = 64;
-    float x = (dphi + float(wofl::PI)) / (2.0f*float(wofl::PI));
-    int q = (int)std::floor(x * Q);
-    if (q >= Q) q = Q-1;
-    if (q < 0) q = 0;
-    return q;
+// McAulay-Quatieri style matching: every (track, peak) pair within
+// MAX_TRACK_JUMP bins is a candidate, and candidates are taken closest
+// first (the peak's refined frequency against track_freq), each track and
+// each peak at most once. Peaks must be sorted by bin (as topk_peaks
+// leaves them).
+inline void match_tracks(const std::vector<Peak>& peaks, const ParametricState& st, TrackMatch& m) {
+    struct Cand { float dist; int track, peak; };
+    std::vector<Cand> cand;
+    size_t j0 = 0;
+    for (size_t i = 0; i < st.tracks.size(); ++i) {
+        int b = st.tracks[i].bin;
+        float f = track_freq(st, st.tracks[i]);
+        while (j0 < peaks.size() && peaks[j0].bin < b - MAX_TRACK_JUMP) ++j0;
+        for (size_t j = j0; j < peaks.size() && peaks[j].bin <= b + MAX_TRACK_JUMP; ++j)
+            cand.push_back(Cand{std::fabs(peaks[j].freq - f), (int)i, (int)j});
+    }
+    std::sort(cand.begin(), cand.end(), [](const Cand& a, const Cand& b) {
+        return a.dist != b.dist ? a.dist < b.dist : a.track != b.track ? a.track < b.track : a.peak < b.peak;
+    });
+    m.peak.assign(st.tracks.size(), -1);
+    std::vector<char> used(peaks.size(), 0);
+    for (const auto& c : cand) {
+        if (m.peak[c.track] >= 0 || used[c.peak]) continue;
+        m.peak[c.track] = c.peak;
+        used[c.peak] = 1;
+    }
+    m.births.clear();
+    for (size_t j = 0; j < peaks.size(); ++j)
+        if (!used[j]) m.births.push_back((int)j);
 }
 
-inline float dequant_phase(int q) {
-    const int Q = 64;
-    float x = (q + 0.5f)/Q;
-    float dphi = x*2.0f*float(wofl::PI) - float(wofl::PI);
-    return dphi;
+// Per frame: one continue bit per live track, then for a continuing track
+// its bin change, magnitude change and phase residual against
+// predict_phase; then the births (count, bin gaps, magnitude, raw phase).
+// The state holds what the decoder reconstructs, so both sides stay in
+// lockstep; `recon` receives the reconstructed peaks for
+// analysis-by-synthesis.
+inline void encode_tracks(BitWriter& bw, const std::vector<Peak>& peaks, ParametricState& st, MagQ& mq,
+                          std::vector<Peak>& recon){
+    TrackMatch m;
+    match_tracks(peaks, st, m);
+    std::vector<Track> next;
+    next.reserve(peaks.size());
+    for (size_t i = 0; i < st.tracks.size(); ++i) {
+        bw.put_bit(m.peak[i] >= 0);
+        if (m.peak[i] < 0) continue;
+        const Track& t = st.tracks[i];
+        const Peak& p = peaks[m.peak[i]];
+        int qmag = mq.encode(p.mag);
+        float pred = predict_phase(st, t, p.bin);
+        int qdphi = quant_phase(p.phase - pred, st.pq.track_bits);
+        Rice::write_sint(bw, p.bin - t.bin, TRACK_BIN_K);
+        Rice::write_sint(bw, qmag - t.qmag, TRACK_DMAG_K);
+        Rice::write_sint(bw, qdphi, phase_residual_k(st.pq));
+        float phase = wrap_phase(pred + dequant_phase(qdphi, st.pq.track_bits));
+        next.push_back(continue_track(st, t, p.bin, qmag, phase));
+    }
+    Rice::write_uint(bw, (uint32_t)m.births.size(), TRACK_BIRTHS_K);
+    int last = 0;
+    for (int j : m.births) {
+        const Peak& p = peaks[j];
+        int qmag = mq.encode(p.mag);
+        int qph = quant_phase(p.phase, st.pq.birth_bits);
+        Rice::write_uint(bw, (uint32_t)(p.bin - last), TRACK_GAP_K);
+        Rice::write_uint(bw, (uint32_t)qmag, TRACK_MAG_K);
+        bw.put_bits((uint32_t)qph & ((1u << st.pq.birth_bits) - 1), st.pq.birth_bits);
+        next.push_back(Track{p.bin, qmag, dequant_phase(qph, st.pq.birth_bits)});
+        last = p.bin;
+    }
+    std::sort(next.begin(), next.end(), [](const Track& a, const Track& b){ return a.bin < b.bin; });
+    st.tracks.swap(next);
+    recon.resize(st.tracks.size());
+    for (size_t i = 0; i < st.tracks.size(); ++i)
+        recon[i] = Peak{st.tracks[i].bin, mq.decode(st.tracks[i].qmag), st.tracks[i].phase};
 }
 
-inline void encode_tracks(BitWriter& bw, const std::vector<Peak>& peaks, ParametricState& st, MagQ& mq){
-    // write count
-    Rice::write_uint(bw, (uint32_t)peaks.size(), 0);
-    for(size_t i=0;i<peaks.size();++i){
-        int bin = peaks[i].bin;
-        int qmag = mq.encode(peaks[i].mag);
-        // Predict phase: last phase (if same bin), else 0
-        float prev = 0.0f;
-        if((int)st.last_bin.size()>i && st.last_bin[i]==bin) prev = st.last_phase[i];
-        float dphi = std::arg(std::polar(1.0f, peaks[i].phase) * std::conj(std::polar(1.0f, prev)));
-        int qdphi = quant_phase(dphi);
-        // delta bin vs last
-        int dbin = bin - ( (int)st.last_bin.size()>i ? st.last_bin[i] : 0 );
-        Rice::write_sint(bw, dbin, 2);
-        Rice::write_sint(bw, qmag, 3);
-        Rice::write_uint(bw, (uint32_t)qdphi, 6);
+// bits encode_tracks would write for peaks, without writing or touching state
+inline size_t tracks_bits(const std::vector<Peak>& peaks, const ParametricState& st, MagQ& mq){
+    TrackMatch m;
+    match_tracks(peaks, st, m);
+    size_t bits = st.tracks.size();
+    for (size_t i = 0; i < st.tracks.size(); ++i) {
+        if (m.peak[i] < 0) continue;
+        const Peak& p = peaks[m.peak[i]];
+        const Track& t = st.tracks[i];
+        bits += Rice::sint_bits(p.bin - t.bin, TRACK_BIN_K);
+        bits += Rice::sint_bits(mq.encode(p.mag) - t.qmag, TRACK_DMAG_K);
+        bits += Rice::sint_bits(quant_phase(p.phase - predict_phase(st, t, p.bin), st.pq.track_bits),
+                                phase_residual_k(st.pq));
     }
-    // update state
-    st.last_bin.resize(peaks.size());
-    st.last_phase.resize(peaks.size());
-    for(size_t i=0;i<peaks.size();++i){ st.last_bin[i]=peaks[i].bin; st.last_phase[i]=peaks[i].phase; }
+    bits += Rice::uint_bits((uint32_t)m.births.size(), TRACK_BIRTHS_K);
+    int last = 0;
+    for (int j : m.births) {
+        bits += Rice::uint_bits((uint32_t)(peaks[j].bin - last), TRACK_GAP_K);
+        bits += Rice::uint_bits((uint32_t)mq.encode(peaks[j].mag), TRACK_MAG_K);
+        bits += st.pq.birth_bits;
+        last = peaks[j].bin;
+    }
+    return bits;
 }
 
 inline std::vector<Peak> decode_tracks(BitReader& br, ParametricState& st, MagQ& mq){
-    uint32_t count = Rice::read_uint(br, 0);
-    std::vector<Peak> peaks(count);
-    for(size_t i=0;i<count;++i){
-        int dbin = Rice::read_sint(br, 2);
-        int qmag = Rice::read_sint(br, 3);
-        int qdphi = (int)br.get_bits(6);
-        int lastb = (int)st.last_bin.size()>i ? st.last_bin[i] : 0;
-        int bin = lastb + dbin;
-        float mag = mq.decode(qmag);
-        float prev = (int)st.last_phase.size()>i ? st.last_phase[i] : 0.0f;
-        float phase = prev + dequant_phase(qdphi);
-        peaks[i] = Peak{bin, mag, phase};
+    std::vector<Track> next;
+    next.reserve(st.tracks.size());
+    for (const Track& t : st.tracks) {
+        if (!br.get_bit()) continue;
+        int bin = t.bin + Rice::read_sint(br, TRACK_BIN_K);
+        int qmag = t.qmag + Rice::read_sint(br, TRACK_DMAG_K);
+        int qdphi = Rice::read_sint(br, phase_residual_k(st.pq));
+        float phase = wrap_phase(predict_phase(st, t, bin) + dequant_phase(qdphi, st.pq.track_bits));
+        next.push_back(continue_track(st, t, bin, qmag, phase));
+    }
+    uint32_t births = Rice::read_uint(br, TRACK_BIRTHS_K);
+    int last = 0;
+    for (uint32_t j = 0; j < births; ++j) {
+        int bin = last + (int)Rice::read_uint(br, TRACK_GAP_K);
+        int qmag = (int)Rice::read_uint(br, TRACK_MAG_K);
+        int qph = (int)br.get_bits(st.pq.birth_bits);
+        if (qph >= (1 << (st.pq.birth_bits - 1))) qph -= 1 << st.pq.birth_bits;
+        next.push_back(Track{bin, qmag, dequant_phase(qph, st.pq.birth_bits)});
+        last = bin;
     }
-    st.last_bin.resize(count);
-    st.last_phase.resize(count);
-    for(size_t i=0;i<count;++i){ st.last_bin[i]=peaks[i].bin; st.last_phase[i]=peaks[i].phase; }
+    std::sort(next.begin(), next.end(), [](const Track& a, const Track& b){ return a.bin < b.bin; });
+    st.tracks.swap(next);
+    std::vector<Peak> peaks(st.tracks.size());
+    for (size_t i = 0; i < st.tracks.size(); ++i)
+        peaks[i] = Peak{st.tracks[i].bin, mq.decode(st.tracks[i].qmag), st.tracks[i].phase};
     return peaks;
 }
 
@@ -88,4 +256,17 @@ inline void synthesize_tracks(const std::vector<Peak>& peaks, std::vector<cpx>&
     }
 }
 
+// Overlap-add one frame of track synthesis into y at pos (y must cover
+// pos+nfft). A bin-centred sinusoid of amplitude A peaks at A*nfft/4 in the
+// Hann-windowed analysis; scaling by 8*hop/nfft restores A after the
+// windowed iSTFT overlap-add.
+inline void synth_frame(const std::vector<Peak>& peaks, size_t nfft, size_t hop,
+                        std::vector<cpx>& X, std::vector<float>& y, size_t pos){
+    X.assign(nfft, cpx(0.0f, 0.0f));
+    synthesize_tracks(peaks, X);
+    const float g = 8.0f * float(hop) / float(nfft);
+    for(auto& c: X) c *= g;
+    istft_frame(y, pos, nfft, X);
+}
+
 } // namespace wofl
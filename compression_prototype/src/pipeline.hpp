@@ -0,0 +1,171 @@
+#pragma once
+#include <vector>
+#include <thread>
+#include <functional>
+#include <chrono>
+#include <algorithm>
+#include <limits>
+#include "fft.hpp"
+#include "analysis.hpp"
+#include "parametric.hpp"
+#include "mdct.hpp"
+#include "residual.hpp"
+#include "bitstream.hpp"
+#include "spsc.hpp"
+#include "channels.hpp"
+
+namespace wofl {
+
+// pulls up to n interleaved samples into dst and returns how many were
+// written; a short count means the source is exhausted
+using SampleSource = std::function<size_t(float *dst, size_t n)>;
+
+// Preallocated unit of work handed from stage to stage. Buffers keep their
+// capacity across frames, so steady-state encoding does not allocate.
+struct LiveFrame {
+    size_t index = 0;
+    bool last = false; // end-of-stream marker, carries no audio
+    std::chrono::steady_clock::time_point t_read;
+    Planar block; // nfft input samples per channel
+    std::vector<std::vector<cpx>> X; // per channel, coded domain after select
+    Planar pw; // power spectrum per channel
+    std::vector<std::vector<Peak>> peaks;
+    BitWriter bits;     // tracks (base layer)
+    BitWriter residual; // enhancement layer
+};
+
+struct LiveStats {
+    size_t frames = 0;
+    double mean_latency_us = 0.0; // read -> written, per frame
+    double max_latency_us = 0.0;
+};
+
+// Pipelined hybrid encoder for live capture:
+//   read -> window/STFT -> peak selection -> coding -> write
+// Each stage runs on its own thread (write on the caller's) and stages are
+// connected by SPSC rings of frame pointers drawn from a pool of `depth`
+// frames that the writer recycles back to the reader. The coding stage
+// keeps the track synthesis and input history needed for the residual, so
+// the output is identical to encode_stream with a single segment.
+inline LiveStats encode_live(const SampleSource &source, const StreamHeader &hdr, const TrackSelect &sel,
+                             BitWriter &bw, size_t depth = 8, const RateParams &rate = {}) {
+    const size_t nfft = hdr.nfft, hop = hdr.hop, ch = hdr.ch;
+    const auto el = hdr.channel_elements();
+    depth = std::max<size_t>(depth, 2);
+
+    std::vector<LiveFrame> pool(depth);
+    LiveFrame stop;
+    stop.last = true;
+
+    SpscQueue<LiveFrame*> free_q(depth), to_fft(depth + 1), to_select(depth + 1),
+                          to_entropy(depth + 1), to_write(depth + 1);
+    for (auto &fr : pool) {
+        fr.block.assign(ch, std::vector<float>(nfft));
+        fr.X.resize(ch);
+        fr.pw.resize(ch);
+        fr.peaks.resize(ch);
+        free_q.push(&fr);
+    }
+
+    size_t total = 0; // samples per channel pulled from the source, read back after join
+
+    std::thread reader([&] {
+        Planar window(ch, std::vector<float>(nfft, 0.0f));
+        std::vector<float> in(nfft * ch);
+        // pull n samples per channel into window[.][pos, pos+n), zero-filling a short read
+        auto pull = [&](size_t pos, size_t n) {
+            size_t got = source(in.data(), n * ch) / ch;
+            for (size_t c = 0; c < ch; ++c) {
+                for (size_t i = 0; i < got; ++i) window[c][pos + i] = in[i * ch + c];
+                std::fill(window[c].begin() + pos + got, window[c].begin() + pos + n, 0.0f);
+            }
+            return got;
+        };
+        size_t n = pull(0, nfft);
+        total = n;
+        bool eof = n < nfft;
+        for (size_t f = 0; f * hop < total + hop; ++f) {
+            LiveFrame *fr = free_q.pop();
+            fr->index = f;
+            fr->t_read = std::chrono::steady_clock::now();
+            for (size_t c = 0; c < ch; ++c) std::copy(window[c].begin(), window[c].end(), fr->block[c].begin());
+            to_fft.push(fr);
+
+            for (auto &w : window) std::copy(w.begin() + hop, w.end(), w.begin());
+            if (eof) {
+                for (auto &w : window) std::fill(w.end() - hop, w.end(), 0.0f);
+                continue;
+            }
+            n = pull(nfft - hop, hop);
+            total += n;
+            eof = n < hop;
+        }
+        to_fft.push(&stop);
+    });
+
+    std::thread transform([&] {
+        for (;;) {
+            LiveFrame *fr = to_fft.pop();
+            if (!fr->last)
+                for (size_t c = 0; c < ch; ++c) stft_frame(fr->block[c], 0, nfft, fr->X[c]);
+            to_select.push(fr);
+            if (fr->last) return;
+        }
+    });
+
+    std::thread select([&] {
+        // the unlimited budget never consults the track state
+        std::vector<ParametricState> st(ch, ParametricState(nfft, hop, hdr.phase_quant()));
+        MagQ mq;
+        PeakPicker picker(sel, nfft, (int)hdr.sr, hdr.track_bins());
+        const double unlimited = std::numeric_limits<double>::infinity();
+        for (;;) {
+            LiveFrame *fr = to_select.pop();
+            if (!fr->last) {
+                for (const auto &e : el) couple_spectra(e, fr->X);
+                for (size_t c = 0; c < ch; ++c) power_spectrum(fr->X[c], fr->pw[c]);
+                if (rate.mode == RateMode::Off)
+                    for (const auto &e : el) pick_tracks(e, fr->pw, fr->X, picker, st, mq, unlimited, fr->peaks);
+            }
+            to_entropy.push(fr);
+            if (fr->last) return;
+        }
+    });
+
+    std::thread entropy([&] {
+        FrameEncoder enc(hdr, sel, rate);
+        for (;;) {
+            LiveFrame *fr = to_entropy.pop();
+            if (!fr->last) enc.code(fr->block, fr->X, fr->pw, fr->peaks, fr->bits, fr->residual);
+            to_write.push(fr);
+            if (fr->last) return;
+        }
+    });
+
+    LiveStats stats;
+    BitWriter seg, enh;
+    for (;;) {
+        LiveFrame *fr = to_write.pop();
+        if (fr->last) break;
+        seg.append(fr->bits);
+        enh.append(fr->residual);
+        double us = std::chrono::duration<double, std::micro>(
+            std::chrono::steady_clock::now() - fr->t_read).count();
+        stats.mean_latency_us += us;
+        stats.max_latency_us = std::max(stats.max_latency_us, us);
+        stats.frames++;
+        free_q.push(fr);
+    }
+
+    reader.join();
+    transform.join();
+    select.join();
+    entropy.join();
+
+    if (stats.frames) stats.mean_latency_us /= double(stats.frames);
+
+    write_single_segment(bw, total, stats.frames, hdr, seg, enh);
+    return stats;
+}
+
+} // namespace wofl
@@ -0,0 +1,170 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "bitio.hpp"
+#include "rice.hpp"
+#include "psy.hpp"
+
+namespace wofl {
+
+// Perceptual noise substitution: residual bands that are noise-like and
+// would be coded coarsely anyway are sent as one energy value instead of
+// coefficients, and the decoder fills them with noise of that energy.
+
+// only bands starting at or above this frequency are candidates
+constexpr float PNS_MIN_HZ = 4000.0f;
+// flatness above which a band counts as noise (a real Gaussian spectrum
+// sits near -5.5 dB, a partial far below)
+constexpr float PNS_FLATNESS_DB = -8.0f;
+// bands with rms under this many quantizer steps mostly quantize to zero
+// and cost next to nothing, so they are left to the coefficient coder
+constexpr float PNS_MIN_RMS_STEPS = 0.5f;
+// narrower bands give no usable flatness estimate
+constexpr int PNS_MIN_WIDTH = 8;
+
+// Rice parameters: first noise energy, then deltas between noise bands
+constexpr uint32_t PNS_FIRST_K = 4;
+constexpr uint32_t PNS_DELTA_K = 2;
+
+// Noise bands of one channel frame over the residual bands; energy holds
+// the quantized mean power (1.5 dB steps, 2^(q/2)) of flagged bands.
+struct NoiseBands {
+    std::vector<uint8_t> flag;
+    std::vector<int> energy;
+};
+
+// first band PNS may use for an MDCT of nbins bins at sample rate sr
+inline size_t pns_first_band(const std::vector<int> &bands, size_t nbins, int sr) {
+    const float bin_hz = 0.5f * float(sr) / float(nbins);
+    size_t b = 0;
+    while (b + 1 < bands.size() && float(bands[b]) * bin_hz < PNS_MIN_HZ) ++b;
+    return b;
+}
+
+// Flag the noise-like bands of coded-domain block C from band `first` on,
+// quantize their energy and zero them in C so the coefficient coder skips
+// them. step(b) is the quantizer step band b is expected to get.
+template <typename StepFn>
+inline void detect_noise(std::vector<float> &C, const std::vector<int> &bands, size_t first, StepFn step,
+                         std::vector<float> &pw, NoiseBands &nb) {
+    size_t n = bands.size() - 1;
+    nb.flag.assign(n, 0);
+    nb.energy.assign(n, 0);
+    power_of(C, pw);
+    for (size_t b = first; b < n; ++b) {
+        int lo = bands[b], hi = bands[b + 1], w = hi - lo;
+        if (w < PNS_MIN_WIDTH) continue;
+        double sum = 0.0, logsum = 0.0;
+        for (int k = lo; k < hi; ++k) {
+            sum += pw[k];
+            logsum += std::log(double(pw[k]) + 1e-30);
+        }
+        double mean = sum / w;
+        if (mean <= 1e-20) continue;
+        double sfm_db = 10.0 / std::log(10.0) * (logsum / w - std::log(mean + 1e-30));
+        float d = step(b);
+        if (sfm_db < PNS_FLATNESS_DB || mean < double(PNS_MIN_RMS_STEPS * d) * double(PNS_MIN_RMS_STEPS * d))
+            continue;
+        nb.flag[b] = 1;
+        nb.energy[b] = (int)std::lround(2.0 * std::log2(mean));
+        std::fill(C.begin() + lo, C.begin() + hi, 0.0f);
+    }
+}
+
+// one bit when no band is substituted, else a flag per candidate band and
+// the energies
+inline void write_noise(BitWriter &bw, const NoiseBands &nb, size_t first) {
+    bool any = std::any_of(nb.flag.begin() + std::min(first, nb.flag.size()), nb.flag.end(),
+                           [](uint8_t f) { return f != 0; });
+    bw.put_bit(any);
+    if (!any) return;
+    for (size_t b = first; b < nb.flag.size(); ++b) bw.put_bit(nb.flag[b]);
+    bool lead = true;
+    int prev = 0;
+    for (size_t b = first; b < nb.flag.size(); ++b) {
+        if (!nb.flag[b]) continue;
+        Rice::write_sint(bw, nb.energy[b] - prev, lead ? PNS_FIRST_K : PNS_DELTA_K);
+        prev = nb.energy[b];
+        lead = false;
+    }
+}
+
+inline void read_noise(BitReader &br, size_t nbands, size_t first, NoiseBands &nb) {
+    nb.flag.assign(nbands, 0);
+    nb.energy.assign(nbands, 0);
+    if (!br.get_bit()) return;
+    for (size_t b = first; b < nbands; ++b) nb.flag[b] = (uint8_t)br.get_bit();
+    bool lead = true;
+    int prev = 0;
+    for (size_t b = first; b < nbands; ++b) {
+        if (!nb.flag[b]) continue;
+        nb.energy[b] = prev + Rice::read_sint(br, lead ? PNS_FIRST_K : PNS_DELTA_K);
+        if (std::abs(nb.energy[b]) > 400) throw std::runtime_error("bad noise energy");
+        prev = nb.energy[b];
+        lead = false;
+    }
+}
+
+// Counter-based noise in [-1, 1): a hash of (seed, index) with no state
+// carried between samples, so the fill loop has no dependency chain and
+// vectorises.
+inline float noise_at(uint32_t seed, uint32_t i) {
+    uint32_t x = seed ^ (i * 0x9E3779B9u);
+    x ^= x >> 16;
+    x *= 0x7FEB352Du;
+    x ^= x >> 15;
+    x *= 0x846CA68Bu;
+    x ^= x >> 16;
+    return float(int32_t(x)) * (1.0f / 2147483648.0f);
+}
+
+// Fill the flagged bands of C with noise scaled to their coded energy.
+// seed should differ per channel and frame.
+inline void fill_noise(std::vector<float> &C, const std::vector<int> &bands, const NoiseBands &nb, uint32_t seed) {
+    for (size_t b = 0; b < nb.flag.size(); ++b) {
+        if (!nb.flag[b]) continue;
+        int lo = bands[b], hi = bands[b + 1];
+        float *c = C.data();
+        float e = 0.0f;
+        for (int k = lo; k < hi; ++k) {
+            c[k] = noise_at(seed, uint32_t(k));
+            e += c[k] * c[k];
+        }
+        float target = float(hi - lo) * std::exp2(0.5f * float(nb.energy[b]));
+        float g = e > 0.0f ? std::sqrt(target / e) : 0.0f;
+        for (int k = lo; k < hi; ++k) c[k] *= g;
+    }
+}
+
+// Encoder side of noise substitution for a stream: the first candidate
+// band and per-channel results, reused frame to frame.
+struct NoiseCoder {
+    bool on = false;
+    size_t first = 0;
+    std::vector<NoiseBands> bands;
+    std::vector<float> pw;
+
+    NoiseCoder(bool enabled, const std::vector<int> &pbands, size_t hop, int sr, size_t ch)
+        : on(enabled), first(pns_first_band(pbands, hop, sr)), bands(ch) {}
+
+    // detect every channel's noise bands, zeroing them in C, and write them
+    // behind one bit for the frame; step(c, b) is the expected quantizer
+    // step of band b in channel c
+    template <typename StepFn>
+    void code(BitWriter &bw, std::vector<std::vector<float>> &C, const std::vector<int> &pbands, StepFn step) {
+        if (!on) return;
+        bool any = false;
+        for (size_t c = 0; c < C.size(); ++c) {
+            detect_noise(C[c], pbands, first, [&](size_t b) { return step(c, b); }, pw, bands[c]);
+            any = any || std::any_of(bands[c].flag.begin(), bands[c].flag.end(), [](uint8_t f) { return f != 0; });
+        }
+        bw.put_bit(any);
+        if (any)
+            for (const auto &nb : bands) write_noise(bw, nb, first);
+    }
+};
+
+} // namespace wofl
@@ -3,38 +3,299 @@
 #include <vector>
 #include <cmath>
 #include <algorithm>
+#include "analysis.hpp"
 
 namespace wofl {
 
+// Critical-band rate (Zwicker & Terhardt), in Bark
+inline float hz_to_bark(float f){
+    return 13.0f*std::atan(0.00076f*f) + 3.5f*std::atan((f/7500.0f)*(f/7500.0f));
+}
+
+// Absolute threshold of hearing (Terhardt), in dB SPL
+inline float ath_db(float f){
+    float khz = std::max(f, 20.0f) / 1000.0f;
+    return 3.64f*std::pow(khz, -0.8f) - 6.5f*std::exp(-0.6f*(khz-3.3f)*(khz-3.3f)) + 1e-3f*khz*khz*khz*khz;
+}
+
+// One band per Bark over the nfft/2 bins of an nfft-point spectrum (or an
+// nfft/2-point MDCT): a new band starts at the first bin of each Bark.
 inline void bark_band_edges(int nfft, int sr, std::vector<int>& bands){
-    // 24 Bark-ish bands up to Nyquist
-    int nb=24;
-    bands.resize(nb+1);
-    for(int b=0;b<=nb;++b){
-        float frac = float(b)/nb;
-        float f = frac * (sr*0.5f);
-        int k = int(std::round(f / (sr*0.5f) * (nfft/2)));
-        bands[b] = std::min(nfft/2, std::max(0, k));
+    int nbins = nfft/2;
+    bands.assign(1, 0);
+    int z0 = 0;
+    for(int k=1;k<nbins;++k){
+        int z = int(hz_to_bark(float(k)*sr/nfft));
+        if(z > z0){ bands.push_back(k); z0 = z; }
     }
+    bands.push_back(nbins);
+}
+
+// x[k]^2 for a real spectrum (an MDCT block); one multiply per bin, so the
+// loop vectorises
+inline void power_of(const std::vector<float>& X, std::vector<float>& pw){
+    pw.resize(X.size());
+    const float* x = X.data();
+    float* out = pw.data();
+    for(size_t k=0;k<X.size();++k) out[k] = x[k]*x[k];
+}
+
+// Running sums of a power spectrum, prefix[k] = pw[0] + ... + pw[k-1], so
+// the energy of any bin range is one subtraction. Kept in double so wide
+// ranges do not lose small bands.
+inline void power_prefix(const std::vector<float>& pw, std::vector<double>& prefix){
+    prefix.resize(pw.size()+1);
+    double s = 0.0;
+    prefix[0] = 0.0;
+    for(size_t k=0;k<pw.size();++k){ s += pw[k]; prefix[k+1] = s; }
+}
+
+// energy of bins [lo, hi)
+inline float range_energy(const std::vector<double>& prefix, int lo, int hi){
+    return float(prefix[hi] - prefix[lo]);
 }
 
-inline std::vector<float> band_energy(const std::vector<float>& mag, const std::vector<int>& bands){
+inline void band_energy(const std::vector<double>& prefix, const std::vector<int>& bands, std::vector<float>& e){
     int nb = (int)bands.size()-1;
-    std::vector<float> e(nb, 0.0f);
-    for(int b=0;b<nb;++b){
-        float s=0.0f;
-        for(int k=bands[b]; k<bands[b+1]; ++k) s += mag[k]*mag[k];
-        e[b]=s + 1e-12f;
-    }
-    return e;
+    e.resize(nb);
+    for(int b=0;b<nb;++b) e[b] = range_energy(prefix, bands[b], bands[b+1]) + 1e-12f;
 }
 
-// Salience score: peak mag^2 divided by local band energy + small constant
-inline float salience_of_peak(const std::vector<float>& bandE, const std::vector<int>& bands, int bin, float mag2){
-    int b=0;
-    while(b+1<(int)bands.size() && bin>=bands[b+1]) ++b;
-    float denom = bandE[std::min(b, (int)bandE.size()-1)] + 1e-9f;
-    return mag2 / denom;
+// band index of every bin below bands.back(), for O(1) lookups
+inline void band_lookup(const std::vector<int>& bands, std::vector<int>& band_of){
+    band_of.resize(bands.back());
+    for(int b=0;b+1<(int)bands.size();++b)
+        std::fill(band_of.begin()+bands[b], band_of.begin()+bands[b+1], b);
+}
+
+// level a full-scale sine is mapped to
+constexpr float PSY_FULL_SCALE_DB = 96.0f;
+
+// a partial must stand this far over the bins 2 and 3 away (7 dB)
+constexpr float PSY_TONAL_RATIO = 5.0f;
+
+// error allowed near a partial, dB under its power
+constexpr float PSY_PARTIAL_SNR_DB = 70.0f;
+
+// bins each side of a partial's peak that do not count as noise: past 6
+// bins the Hann leakage of a partial is about 60 dB down
+constexpr int PSY_PARTIAL_SPAN = 6;
+
+// Tonal-component test of MPEG-1 psychoacoustic model 1 on a Hann-windowed
+// STFT power spectrum: a local maximum PSY_TONAL_RATIO over the bins two
+// and three away on both sides is a partial. peaks[k] is 1 at each
+// partial's peak bin. Unlike the flatness of a 2-3 bin band this does not
+// depend on where the partial falls between bins or on its phase.
+inline void tonal_peaks(const std::vector<float>& pw, std::vector<uint8_t>& peaks){
+    const int n = (int)pw.size();
+    peaks.assign(n, 0);
+    for(int k=3;k+3<n;++k){
+        float p = pw[k];
+        if(!(p > pw[k-1] && p >= pw[k+1])) continue;
+        float t = p / PSY_TONAL_RATIO;
+        peaks[k] = pw[k-2] < t && pw[k+2] < t && pw[k-3] < t && pw[k+3] < t;
+    }
 }
 
+// Partials of one channel that hold from frame to frame. Noise passes the
+// one-frame test (tonal_peaks) now and then; a stationary partial passes
+// it frame after frame. A peak is held once it passes twice in a row
+// within a bin, and stays held while it is a local maximum within a bin of
+// where it was, so the partial is still covered in a block it only half
+// fills, at its end. A stream's first block starts half a block before
+// the signal, which widens a partial past the test, so in a run's first
+// frame every local maximum counts; the second takes the one-frame test
+// alone.
+struct PartialTracker {
+    std::vector<uint8_t> peaks, held, cur; // last frame's peaks and held peaks; scratch
+    size_t frames = 0;
+
+    // held peak bins of pw, the next frame's power spectrum, into out
+    void update(const std::vector<float>& pw, std::vector<uint8_t>& out){
+        tonal_peaks(pw, cur);
+        const size_t n = cur.size();
+        out.assign(n, 0);
+        if(frames == 0){
+            for(size_t k=1;k+1<n;++k) out[k] = pw[k] > pw[k-1] && pw[k] >= pw[k+1];
+        }else if(frames == 1){
+            out = cur;
+        }else{
+            auto near = [n](const std::vector<uint8_t>& v, size_t k){
+                return v[k] || (k > 0 && v[k-1]) || (k+1 < n && v[k+1]);
+            };
+            for(size_t k=1;k+1<n;++k){
+                bool local = pw[k] > pw[k-1] && pw[k] >= pw[k+1];
+                out[k] = (cur[k] && near(peaks, k)) || (local && near(held, k));
+            }
+        }
+        peaks.swap(cur);
+        held = out;
+        ++frames;
+    }
+};
+
+// Per-band masking model (Johnston-style) over an nbins-point power
+// spectrum: Bark bands, Schroeder spreading between bands, tonality (the
+// share of a band's STFT power in partials, see tonal_peaks) choosing
+// between the tone- and noise-masking offsets, and the absolute threshold
+// of hearing as a floor.
+// fs_power is the band-summed power of a full-scale sine, which anchors
+// the spectrum to PSY_FULL_SCALE_DB.
+struct PsyModel {
+    std::vector<int> bands;
+    std::vector<float> bark;    // band centre, Bark
+    std::vector<float> ath;     // per band, power units
+    std::vector<float> spread;  // [masker band * nb + band], column-normalised
+    std::vector<int> band_of;   // band of each bin
+
+    PsyModel() = default;
+    PsyModel(int nbins, int sr, float fs_power){
+        bark_band_edges(2*nbins, sr, bands);
+        band_lookup(bands, band_of);
+        int nb = (int)bands.size()-1;
+        bark.resize(nb);
+        ath.resize(nb);
+        const float bin_hz = 0.5f*sr/nbins;
+        for(int b=0;b<nb;++b){
+            bark[b] = hz_to_bark(0.5f*(bands[b]+bands[b+1])*bin_hz);
+            float lo = 1e9f;
+            for(int k=bands[b];k<bands[b+1];++k) lo = std::min(lo, ath_db((k+0.5f)*bin_hz));
+            ath[b] = (bands[b+1]-bands[b]) * fs_power * std::pow(10.0f, (lo - PSY_FULL_SCALE_DB)/10.0f);
+        }
+        spread.assign(size_t(nb)*nb, 0.0f);
+        for(int b=0;b<nb;++b){
+            float sum = 0.0f;
+            for(int j=0;j<nb;++j){
+                float dz = bark[b] - bark[j] + 0.474f;
+                float db = 15.81f + 7.5f*dz - 17.5f*std::sqrt(1.0f + dz*dz);
+                float v = std::pow(10.0f, db/10.0f);
+                spread[size_t(j)*nb+b] = v;
+                sum += v;
+            }
+            for(int j=0;j<nb;++j) spread[size_t(j)*nb+b] /= sum;
+        }
+    }
+
+    size_t num_bands() const { return bands.size()-1; }
+
+    // allowed noise power per band for one frame's power spectrum, with
+    // tonality from stft, a Hann-windowed power spectrum on the same bins
+    // (the same vector when power is one), and the peak bins of its
+    // partials (tonal_peaks). A partial's power is its main lobe, the peak
+    // bin and its two neighbours.
+    // With partials set the threshold is also capped for the residual
+    // coder: the track layer leaves its error around each partial, and a
+    // partial does not mask changes to itself, so near partials only the
+    // noise-like power masks (with the noise offset), and no further than
+    // PSY_PARTIAL_SNR_DB under the spread partials. Noise is what stays
+    // once PSY_PARTIAL_SPAN bins each side of every partial are taken out.
+    void thresholds(const std::vector<float>& power, const std::vector<float>& stft, const std::vector<uint8_t>& peaks,
+                    std::vector<float>& thr, bool partials = false){
+        const int nb = (int)num_bands();
+        power_prefix(power, prefix);
+        tonal.assign(stft.size(), 0.0f);
+        noise = stft;
+        const size_t n = std::min(peaks.size(), stft.size()), span = PSY_PARTIAL_SPAN;
+        for(size_t k=1;k+1<n;++k){
+            if(!peaks[k]) continue;
+            for(size_t j=k-1;j<=k+1;++j) tonal[j] = stft[j];
+            for(size_t j=k-std::min(k, span);j<=std::min(k+span, n-1);++j) noise[j] = 0.0f;
+        }
+        // band sums of the STFT and of its tonal and noise parts from
+        // prefix sums; the STFT's are the power's when they are one vector
+        const std::vector<double>* sp = &prefix;
+        if(&stft != &power){ power_prefix(stft, sprefix); sp = &sprefix; }
+        power_prefix(tonal, tprefix);
+        power_prefix(noise, nprefix);
+        e.resize(nb);
+        alpha.resize(nb);
+        rest.resize(nb);
+        double etot = 0.0, stot = 0.0;
+        for(int b=0;b<nb;++b){
+            const int lo = std::min(bands[b], (int)stft.size()), hi = std::min(bands[b+1], (int)stft.size());
+            e[b] = range_energy(prefix, bands[b], bands[b+1]);
+            float all = range_energy(*sp, lo, hi);
+            alpha[b] = all > 0.0f ? range_energy(tprefix, lo, hi)/all : 0.0f;
+            rest[b] = range_energy(nprefix, lo, hi);
+            etot += e[b];
+            stot += all;
+        }
+        // the STFT's noise on the scale of power
+        const float g = stot > 0.0 ? float(etot/stot) : 0.0f;
+        thr.resize(nb);
+        for(int b=0;b<nb;++b){
+            float c = 0.0f, cp = 0.0f, cn = 0.0f;
+            for(int j=0;j<nb;++j){
+                float s = e[j]*spread[size_t(j)*nb+b];
+                c += s;
+                cp += alpha[j]*s;
+                cn += g*rest[j]*spread[size_t(j)*nb+b];
+            }
+            float offset = alpha[b]*(14.5f + bark[b]) + (1.0f-alpha[b])*5.5f;
+            thr[b] = std::max(c*std::pow(10.0f, -offset/10.0f), ath[b]);
+            if(partials && cp > 0.0f){
+                float cap = std::max(cp*std::pow(10.0f, -PSY_PARTIAL_SNR_DB/10.0f), cn*std::pow(10.0f, -5.5f/10.0f));
+                thr[b] = std::min(thr[b], std::max(cap, ath[b]));
+            }
+        }
+    }
+
+    // scratch reused by thresholds(): prefix sums of power, stft, tonal
+    // and noise power, per-bin tonal and noise power, band energy,
+    // tonality and noise
+    std::vector<double> prefix, sprefix, tprefix, nprefix;
+    std::vector<float> tonal, noise, e, alpha, rest;
+};
+
+// How track peaks are ranked: by power, or by signal-to-mask ratio so
+// loud low bins do not crowd out audible partials elsewhere.
+enum class PeakRank { Magnitude, Salience };
+
+struct TrackSelect {
+    int K = 128;                // most tracks per channel and frame
+    PeakRank rank = PeakRank::Salience;
+    float min_smr_db = 0.0f;    // salience: drop peaks this far under their mask
+};
+
+// Per-thread peak selection for an nfft-point STFT. In salience mode each
+// candidate's score is its main-lobe power (the peak bin and its two
+// neighbours) over its band's masking threshold; peaks below min_smr_db
+// are dropped, so K becomes a cap and quiet or masked frames use fewer
+// tracks.
+struct PeakPicker {
+    TrackSelect sel;
+    PsyModel model;
+    std::vector<float> thr;
+    std::vector<uint8_t> peaks;
+    float min_smr = 1.0f;
+    size_t max_bin = 0;         // peaks at or above this bin are ignored
+
+    PeakPicker() = default;
+    PeakPicker(const TrackSelect& s, size_t nfft, int sr, size_t bins) : sel(s), max_bin(bins) {
+        // a full-scale sine in a Hann-windowed nfft-point frame holds
+        // 3*nfft^2/32 of one-sided power
+        if(sel.rank == PeakRank::Salience)
+            model = PsyModel(int(nfft/2), sr, 3.0f*float(nfft)*float(nfft)/32.0f);
+        min_smr = std::pow(10.0f, sel.min_smr_db/10.0f);
+    }
+
+    void pick(const std::vector<float>& pw, const std::vector<cpx>& X, std::vector<Peak>& out){
+        find_peaks(pw, out);
+        if(max_bin < pw.size())
+            out.erase(std::remove_if(out.begin(), out.end(), [&](const Peak& p){ return size_t(p.bin) >= max_bin; }), out.end());
+        if(sel.rank == PeakRank::Salience){
+            tonal_peaks(pw, peaks);
+            model.thresholds(pw, pw, peaks, thr);
+            for(auto& p: out){
+                float lobe = range_energy(model.prefix, p.bin-1, p.bin+2);
+                int b = model.band_of[std::min<size_t>(size_t(p.bin), model.band_of.size()-1)];
+                p.score = lobe / thr[b];
+            }
+            out.erase(std::remove_if(out.begin(), out.end(), [&](const Peak& p){ return p.score < min_smr; }), out.end());
+        }
+        keep_strongest(out, sel.K);
+        finish_peaks(pw, X, out);
+    }
+};
+
 } // namespace wofl
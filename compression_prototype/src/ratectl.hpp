@@ -0,0 +1,237 @@
+#pragma once
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <stdexcept>
+#include "analysis.hpp"
+#include "parametric.hpp"
+#include "residual.hpp"
+#include "rice.hpp"
+#include "psy.hpp"
+
+namespace wofl {
+
+enum class RateMode { Off, CBR, ABR };
+
+struct RateParams {
+    RateMode mode = RateMode::Off;
+    double kbps = 0.0;
+};
+
+// Per-frame residual step index: step = base * 2^(s/4). It is sent as a
+// Rice(0) delta against the previous frame, so fixed-quality streams pay
+// one bit per frame.
+constexpr int STEP_INDEX_MIN = -60;
+constexpr int STEP_INDEX_MAX = 60;
+
+inline float step_for_index(float base, int s) {
+    return base * std::exp2(float(s) / 4.0f);
+}
+
+// share of the nominal frame budget the track layer may use
+constexpr double TRACK_SHARE = 0.5;
+
+// Bit budget and reservoir for one run of consecutive frames (a segment).
+// CBR: a frame may spend its nominal bits plus what earlier frames saved,
+// and savings are capped at a few frames, so the stream never runs ahead
+// of the channel by more than the reservoir. ABR: the reservoir may go into
+// debt and is spread over the following frames, so only the long-term
+// average tracks the target.
+struct RateControl {
+    RateMode mode = RateMode::Off;
+    double frame_bits = 0.0;
+    double reservoir = 0.0;
+    double reservoir_max = 0.0;
+
+    RateControl() = default;
+    // a frame is hop samples of every channel
+    RateControl(const RateParams &p, size_t hop, int sr) : mode(p.mode) {
+        if (mode == RateMode::Off) return;
+        frame_bits = p.kbps * 1000.0 * double(hop) / double(sr);
+        reservoir_max = mode == RateMode::CBR ? 4.0 * frame_bits
+                                              : 2.0 * p.kbps * 1000.0; // ~2 s
+    }
+
+    bool active() const { return mode != RateMode::Off; }
+
+    // bit budget for the whole frame
+    double budget() const {
+        if (!active()) return std::numeric_limits<double>::infinity();
+        if (mode == RateMode::CBR) return frame_bits + 0.5 * reservoir;
+        return std::max(0.0, frame_bits + reservoir / 8.0);
+    }
+
+    // bit budget for the track layer (not reservoir dependent, so track
+    // selection stays independent of the residual pass)
+    double track_budget() const {
+        return active() ? TRACK_SHARE * frame_bits : std::numeric_limits<double>::infinity();
+    }
+
+    void commit(double used) {
+        if (!active()) return;
+        reservoir += frame_bits - used;
+        reservoir = std::min(reservoir, reservoir_max);
+        if (mode == RateMode::ABR) reservoir = std::max(reservoir, -reservoir_max);
+    }
+};
+
+// Best-ranked peaks whose coded size fits the track budget: start from the
+// picker's selection and shrink proportionally to the estimated overshoot.
+// Each smaller set is a subset of the last, so it is cut down in place.
+inline void select_tracks(const std::vector<float> &pw, const std::vector<cpx> &X, PeakPicker &picker,
+                          const ParametricState &st, MagQ &mq, double budget, std::vector<Peak> &peaks) {
+    picker.pick(pw, X, peaks);
+    if (std::isinf(budget)) return;
+    int K = (int)peaks.size();
+    for (int it = 0; it < 4 && K > 0; ++it) {
+        double cost = double(tracks_bits(peaks, st, mq));
+        if (cost <= budget) break;
+        K = std::max(0, std::min(K - 1, int(K * budget / cost)));
+        keep_strongest(peaks, K);
+    }
+}
+
+// Per-band scalefactors: extra quarter-octave steps on top of the frame
+// step index, set from the masking threshold so each band's quantization
+// noise stays just under it. They are never negative, so at fixed quality
+// the header step remains the finest step used; rate control may move the
+// frame index below zero to spend spare bits under the mask.
+constexpr int SCALEFACTOR_MAX = 60;
+
+// thr: allowed noise power per band; a uniform quantizer with step d adds
+// d^2/12 per coefficient
+inline void scalefactors(const std::vector<float> &thr, const std::vector<int> &bands, float base,
+                         std::vector<int> &sf) {
+    sf.resize(thr.size());
+    for (size_t j = 0; j < thr.size(); ++j) {
+        float w = float(bands[j + 1] - bands[j]);
+        float d = std::sqrt(12.0f * thr[j] / w);
+        int v = int(std::floor(4.0f * std::log2(std::max(d, 1e-30f) / base)));
+        sf[j] = std::min(std::max(v, 0), SCALEFACTOR_MAX);
+    }
+}
+
+// Bands holding a nonzero quantized coefficient. Only those need a
+// scalefactor, and the decoder knows them once the block is decoded, so
+// scalefactors follow the coefficients.
+inline void active_bands(const std::vector<float> &q, const std::vector<int> &bands, float thresh,
+                         std::vector<uint8_t> &active) {
+    active.assign(bands.size() - 1, 0);
+    for (size_t j = 0; j + 1 < bands.size(); ++j)
+        for (int k = bands[j]; k < bands[j + 1]; ++k)
+            if (std::fabs(q[k]) >= thresh) { active[j] = 1; break; }
+}
+
+// first active band Rice(3), then deltas between active bands Rice(1)
+inline void write_scalefactors(BitWriter &bw, const std::vector<int> &sf, const std::vector<uint8_t> &active) {
+    int prev = -1;
+    for (size_t j = 0; j < sf.size(); ++j) {
+        if (!active[j]) continue;
+        if (prev < 0) Rice::write_uint(bw, (uint32_t)sf[j], 3);
+        else Rice::write_sint(bw, sf[j] - prev, 1);
+        prev = sf[j];
+    }
+}
+
+inline size_t scalefactor_bits(const std::vector<int> &sf, const std::vector<uint8_t> &active) {
+    size_t bits = 0;
+    int prev = -1;
+    for (size_t j = 0; j < sf.size(); ++j) {
+        if (!active[j]) continue;
+        bits += prev < 0 ? Rice::uint_bits((uint32_t)sf[j], 3) : Rice::sint_bits(sf[j] - prev, 1);
+        prev = sf[j];
+    }
+    return bits;
+}
+
+// inactive bands get 0 (their coefficients are all zero anyway)
+inline void read_scalefactors(BitReader &br, const std::vector<uint8_t> &active, std::vector<int> &sf) {
+    sf.assign(active.size(), 0);
+    int prev = -1;
+    for (size_t j = 0; j < active.size(); ++j) {
+        if (!active[j]) continue;
+        sf[j] = prev < 0 ? (int)Rice::read_uint(br, 3) : prev + Rice::read_sint(br, 1);
+        if (sf[j] < 0 || sf[j] > SCALEFACTOR_MAX) throw std::runtime_error("bad scalefactor");
+        prev = sf[j];
+    }
+}
+
+// Residual coding of consecutive frames: picks each frame's step index
+// from what is left of the frame budget after `frame_bits` bits of side
+// information, writes the index delta and, per channel, the residual
+// block and the scalefactors of its active bands, and charges the frame
+// to the reservoir. Coefficients are divided by their band's step and
+// coded at unit step; sf holds each channel's band scalefactors over
+// `bands` (empty = all zero, none sent).
+struct ResidualCoder {
+    float base;
+    RateControl rc;
+    int prev_s = 0;
+    std::vector<std::vector<float>> scaled;
+    std::vector<uint8_t> active;
+
+    ResidualCoder(float base_step, const RateControl &rate) : base(base_step), rc(rate) {}
+
+    void scale(const std::vector<std::vector<float>> &C, const std::vector<std::vector<int>> &sf,
+               const std::vector<int> &bands, int s) {
+        scaled.resize(C.size());
+        for (size_t c = 0; c < C.size(); ++c) {
+            scaled[c].resize(C[c].size());
+            if (sf.empty()) {
+                float step = step_for_index(base, s);
+                for (size_t k = 0; k < C[c].size(); ++k) scaled[c][k] = C[c][k] / step;
+                continue;
+            }
+            for (size_t j = 0; j + 1 < bands.size(); ++j) {
+                float step = step_for_index(base, s + sf[c][j]);
+                for (int k = bands[j]; k < bands[j + 1]; ++k) scaled[c][k] = C[c][k] / step;
+            }
+        }
+    }
+
+    size_t cost(const std::vector<std::vector<float>> &C, const std::vector<std::vector<int>> &sf,
+                const std::vector<int> &bands, int s) {
+        scale(C, sf, bands, s);
+        size_t bits = 0;
+        for (size_t c = 0; c < scaled.size(); ++c) {
+            bits += residual_bits(scaled[c], 0.5f, ResidualQ(1.0f));
+            if (sf.empty()) continue;
+            active_bands(scaled[c], bands, 0.5f, active);
+            bits += scalefactor_bits(sf[c], active);
+        }
+        return bits;
+    }
+
+    // Finest step index whose estimated cost fits `budget` bits. Cost falls
+    // as the step grows, so binary search over the index.
+    int select(const std::vector<std::vector<float>> &C, const std::vector<std::vector<int>> &sf,
+               const std::vector<int> &bands, double budget) {
+        int lo = STEP_INDEX_MIN, hi = STEP_INDEX_MAX;
+        if (double(cost(C, sf, bands, lo)) <= budget) return lo;
+        while (hi - lo > 1) {
+            int mid = (lo + hi) / 2;
+            if (double(cost(C, sf, bands, mid)) <= budget) hi = mid; else lo = mid;
+        }
+        return hi;
+    }
+
+    void code(BitWriter &bw, const std::vector<std::vector<float>> &C, const std::vector<std::vector<int>> &sf,
+              const std::vector<int> &bands, size_t frame_bits) {
+        size_t start = bw.bit_count();
+        int s = 0;
+        if (rc.active()) s = select(C, sf, bands, rc.budget() - double(frame_bits) - 2.0);
+        Rice::write_sint(bw, s - prev_s, 0);
+        prev_s = s;
+        scale(C, sf, bands, s);
+        for (size_t c = 0; c < scaled.size(); ++c) {
+            encode_residual(bw, scaled[c], 0.5f, ResidualQ(1.0f));
+            if (sf.empty()) continue;
+            active_bands(scaled[c], bands, 0.5f, active);
+            write_scalefactors(bw, sf[c], active);
+        }
+        rc.commit(double(frame_bits + bw.bit_count() - start));
+    }
+};
+
+} // namespace wofl
@@ -0,0 +1,209 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <numeric>
+#include <algorithm>
+#include <stdexcept>
+#include <functional>
+#include "constants.hpp"
+
+namespace wofl {
+
+constexpr int RESAMPLE_HALF_TAPS = 48;   // filter taps each side at unity ratio
+constexpr double RESAMPLE_BETA = 9.0;    // Kaiser window, about 90 dB stopband
+constexpr uint64_t RESAMPLE_MAX_PHASES = 4096;
+
+namespace detail {
+
+// zeroth-order modified Bessel function of the first kind
+inline double bessel_i0(double x) {
+    double sum = 1.0, term = 1.0;
+    for (int k = 1; k < 64 && term > 1e-12 * sum; ++k) {
+        double q = x / (2.0 * k);
+        term *= q * q;
+        sum += term;
+    }
+    return sum;
+}
+
+} // namespace detail
+
+// Streaming polyphase resampler by the rational ratio L/M = out/in (in
+// lowest terms). Output frame k sits at input time k*M/L; its phase
+// k*M mod L picks one of L Kaiser-windowed sinc filters, precomputed,
+// stored contiguously and padded to a multiple of 8 taps so the dot
+// product runs in 8 independent lanes. The cutoff follows the lower rate,
+// so downsampling is band-limited before decimation, and each phase has
+// unit DC gain. Output is aligned with the input and comes to
+// ceil(frames * L / M) frames once flushed; equal rates copy through.
+class Resampler {
+    size_t ch;
+    uint64_t L = 1, M = 1;
+    size_t half = 0, taps = 0;            // filter half length; taps per phase
+    size_t reach = 0;                     // last input read, ahead of base
+    std::vector<float> bank;              // L phases of taps
+    std::vector<std::vector<float>> hist; // per channel, input from index origin
+    int64_t origin = 0;                   // input index of hist[.][0]
+    uint64_t received = 0;                // input frames in
+    uint64_t produced = 0;                // output frames out
+    uint64_t base = 0, phase = 0;         // produced * M = base * L + phase
+
+    // output frames while the input they read is below avail, up to
+    // limit in all, appended to out
+    size_t run(std::vector<float> &out, uint64_t avail, uint64_t limit) {
+        size_t m = 0, at = out.size();
+        while (produced < limit && base + reach < avail) {
+            const float *h = bank.data() + phase * taps;
+            const size_t off = size_t(int64_t(base) + 1 - int64_t(half) - origin);
+            out.resize(at + ch);
+            for (size_t c = 0; c < ch; ++c) {
+                const float *x = hist[c].data() + off;
+                float acc[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+                for (size_t j = 0; j < taps; j += 8)
+                    for (size_t l = 0; l < 8; ++l) acc[l] += h[j + l] * x[j + l];
+                out[at + c] = ((acc[0] + acc[4]) + (acc[1] + acc[5])) + ((acc[2] + acc[6]) + (acc[3] + acc[7]));
+            }
+            at += ch;
+            ++m;
+            ++produced;
+            base += M / L;
+            phase += M % L;
+            if (phase >= L) { phase -= L; ++base; }
+        }
+        // drop the input no later output reaches
+        int64_t keep = int64_t(base) + 1 - int64_t(half);
+        if (keep > origin) {
+            size_t drop = size_t(std::min<int64_t>(keep - origin, int64_t(hist[0].size())));
+            for (auto &v : hist) v.erase(v.begin(), v.begin() + drop);
+            origin += int64_t(drop);
+        }
+        return m;
+    }
+
+public:
+    Resampler(int channels, int in_rate, int out_rate, int half_taps = RESAMPLE_HALF_TAPS)
+        : ch(size_t(channels)), hist(size_t(channels)) {
+        if (channels <= 0 || in_rate <= 0 || out_rate <= 0 || half_taps <= 0)
+            throw std::runtime_error("bad resampler configuration");
+        uint64_t g = std::gcd(uint64_t(in_rate), uint64_t(out_rate));
+        L = uint64_t(out_rate) / g;
+        M = uint64_t(in_rate) / g;
+        if (L == M) return;
+        if (L > RESAMPLE_MAX_PHASES) throw std::runtime_error("resampling ratio needs too many filter phases");
+
+        // Kaiser's estimate: beta gives the stopband attenuation, and
+        // 2*half_taps taps a transition band of (A - 8) / (2.285 (N - 1))
+        // rad/sample, centred on the cutoff so the stopband starts at the
+        // lower Nyquist. Cutoff in cycles per input sample; the filter
+        // stretches by the ratio when it narrows.
+        const double ratio = std::min(1.0, double(L) / double(M));
+        const double atten = RESAMPLE_BETA / 0.1102 + 8.7;
+        const double transition = (atten - 8.0) / (2.285 * (2.0 * half_taps - 1.0)) / (2.0 * PI);
+        const double fc = ratio * (0.5 - 0.5 * transition);
+        half = size_t(std::ceil(double(half_taps) / ratio));
+        taps = (2 * half + 7) / 8 * 8;
+        reach = taps - half; // the padding taps are zero but still read
+        bank.assign(L * taps, 0.0f);
+        std::vector<double> h(2 * half);
+        for (uint64_t p = 0; p < L; ++p) {
+            double sum = 0.0;
+            for (size_t j = 0; j < 2 * half; ++j) {
+                double d = double(j) + 1.0 - double(half) - double(p) / double(L); // tap time - output time
+                double r = d / double(half);
+                double w = std::fabs(r) < 1.0 ? detail::bessel_i0(RESAMPLE_BETA * std::sqrt(1.0 - r * r)) : 0.0;
+                double s = std::fabs(d) < 1e-12 ? 2.0 * fc : std::sin(2.0 * PI * fc * d) / (PI * d);
+                h[j] = s * w;
+                sum += h[j];
+            }
+            for (size_t j = 0; j < 2 * half; ++j) bank[p * taps + j] = float(h[j] / sum);
+        }
+        // the history starts with the zeros before the first sample
+        origin = 1 - int64_t(half);
+        for (auto &v : hist) v.assign(half - 1, 0.0f);
+    }
+
+    // frames of interleaved input; appends the output frames now complete
+    // to out (interleaved) and returns how many
+    size_t process(const float *in, size_t frames, std::vector<float> &out) {
+        if (L == M) {
+            out.insert(out.end(), in, in + frames * ch);
+            return frames;
+        }
+        for (size_t c = 0; c < ch; ++c) {
+            auto &v = hist[c];
+            size_t n0 = v.size();
+            v.resize(n0 + frames);
+            for (size_t i = 0; i < frames; ++i) v[n0 + i] = in[i * ch + c];
+        }
+        received += frames;
+        return run(out, received, UINT64_MAX);
+    }
+
+    // the output the filter still holds back, against silence after the
+    // end of the input
+    size_t flush(std::vector<float> &out) {
+        if (L == M) return 0;
+        for (auto &v : hist) v.resize(v.size() + reach, 0.0f);
+        return run(out, received + reach, (received * L + M - 1) / M);
+    }
+};
+
+// whole interleaved buffer from in_rate to out_rate
+inline std::vector<float> resample(const std::vector<float> &pcm, int channels, int in_rate, int out_rate) {
+    Resampler r(channels, in_rate, out_rate);
+    const size_t frames = pcm.size() / size_t(channels);
+    std::vector<float> out;
+    out.reserve((size_t(uint64_t(frames) * uint64_t(out_rate) / uint64_t(in_rate)) + 1) * size_t(channels));
+    r.process(pcm.data(), frames, out);
+    r.flush(out);
+    return out;
+}
+
+// one plane per channel, each resampled in place
+inline void resample_planes(std::vector<std::vector<float>> &planes, int in_rate, int out_rate) {
+    std::vector<float> y;
+    for (auto &p : planes) {
+        Resampler r(1, in_rate, out_rate);
+        y.clear();
+        r.process(p.data(), p.size(), y);
+        r.flush(y);
+        p.swap(y);
+    }
+}
+
+// Pull-side resampling for a streamed source: read(dst, frames) fills dst
+// with up to frames interleaved input frames and returns how many, 0 at
+// the end; pull() hands out the resampled samples n at a time, short only
+// once the input and the filter are drained.
+class ResampledReader {
+    Resampler rs;
+    std::function<size_t(float *, size_t)> read;
+    std::vector<float> block, fifo;
+    size_t head = 0; // fifo[head, end) not yet handed out
+    bool drained = false;
+
+public:
+    static constexpr size_t BLOCK_FRAMES = 4096;
+
+    ResampledReader(int channels, int in_rate, int out_rate, std::function<size_t(float *, size_t)> read_)
+        : rs(channels, in_rate, out_rate), read(std::move(read_)),
+          block(BLOCK_FRAMES * size_t(channels)) {}
+
+    // up to n interleaved output samples into dst; returns how many
+    size_t pull(float *dst, size_t n) {
+        while (fifo.size() - head < n && !drained) {
+            fifo.erase(fifo.begin(), fifo.begin() + head);
+            head = 0;
+            size_t got = read(block.data(), BLOCK_FRAMES);
+            if (got) rs.process(block.data(), got, fifo);
+            else { rs.flush(fifo); drained = true; }
+        }
+        size_t m = std::min(n, fifo.size() - head);
+        std::copy(fifo.begin() + head, fifo.begin() + head + m, dst);
+        head += m;
+        return m;
+    }
+};
+
+} // namespace wofl
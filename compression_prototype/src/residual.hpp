@@ -16,44 +16,54 @@ struct ResidualQ {
     float dq(int qv) const { return qv*step; }
 };
 
+// Rice parameters for zero runs and nonzero quantized values
+constexpr uint32_t RES_RUN_K = 2;
+constexpr uint32_t RES_VAL_K = 1;
+
 inline void encode_residual(BitWriter& bw, const std::vector<float>& coeffs, float thresh, const ResidualQ& rq){
-    // RLE zero + Rice of nonzeros
+    // (zero run, nonzero value) pairs; a zero value ends the block
     int run=0;
     for(size_t i=0;i<coeffs.size();++i){
         float c = coeffs[i];
-        if(std::fabs(c) < thresh){
+        int qv = std::fabs(c) < thresh ? 0 : rq.q(c);
+        if(qv==0){
             run++;
         } else {
-            // flush run
-            Rice::write_uint(bw, (uint32_t)run, 0);
+            Rice::write_uint(bw, (uint32_t)run, RES_RUN_K);
+            Rice::write_sint(bw, qv, RES_VAL_K);
             run=0;
-            int qv = rq.q(c);
-            Rice::write_sint(bw, qv, 3);
         }
     }
-    // flush tail run
-    Rice::write_uint(bw, (uint32_t)run, 0);
-    // end marker: run=0 then q=0
-    Rice::write_uint(bw, 0, 0);
-    Rice::write_sint(bw, 0, 3);
+    // end marker: the trailing zero run is implied
+    Rice::write_uint(bw, 0, RES_RUN_K);
+    Rice::write_sint(bw, 0, RES_VAL_K);
 }
 
-inline void decode_residual(BitReader& br, std::vector<float>& coeffs, const ResidualQ& rq){
-    size_t pos=0; coeffs.assign(coeffs.size(), 0.0f);
-    while(pos < coeffs.size()){
-        uint32_t run = Rice::read_uint(br, 0);
-        if(run==0){
-            int qv = Rice::read_sint(br, 3);
-            if(qv==0){
-                // end marker
-                break;
-            } else {
-                if(pos<coeffs.size()) coeffs[pos++] = rq.dq(qv);
-            }
+// bits encode_residual would write, without writing
+inline size_t residual_bits(const std::vector<float>& coeffs, float thresh, const ResidualQ& rq){
+    size_t bits = 0;
+    uint32_t run = 0;
+    for(float c: coeffs){
+        int qv = std::fabs(c) < thresh ? 0 : rq.q(c);
+        if(qv==0){
+            run++;
         } else {
-            pos += run;
+            bits += Rice::uint_bits(run, RES_RUN_K) + Rice::sint_bits(qv, RES_VAL_K);
+            run = 0;
         }
     }
+    return bits + Rice::uint_bits(0, RES_RUN_K) + Rice::sint_bits(0, RES_VAL_K);
+}
+
+inline void decode_residual(BitReader& br, std::vector<float>& coeffs, const ResidualQ& rq){
+    size_t pos=0; coeffs.assign(coeffs.size(), 0.0f);
+    for(;;){
+        pos += Rice::read_uint(br, RES_RUN_K);
+        int qv = Rice::read_sint(br, RES_VAL_K);
+        if(qv==0) break; // end marker
+        if(pos<coeffs.size()) coeffs[pos] = rq.dq(qv);
+        pos++;
+    }
 }
 
 } // namespace wofl
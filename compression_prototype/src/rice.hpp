@@ -12,12 +12,12 @@ inline int32_t unzigzag(uint32_t u){ return (u>>1) ^ -int32_t(u&1); }
 struct Rice {
     static void write_uint(BitWriter& bw, uint32_t v, uint32_t k){
         uint32_t q = v >> k;
-        for(uint32_t i=0;i<q;++i) bw.put_bit(1);
+        bw.put_ones(q);
         bw.put_bit(0);
         bw.put_bits(v & ((1u<<k)-1u), k);
     }
     static uint32_t read_uint(BitReader& br, uint32_t k){
-        uint32_t q=0; while(br.get_bit()) ++q;
+        uint32_t q = br.count_ones();
         uint32_t r = k? br.get_bits(k) : 0u;
         return (q<<k) | r;
     }
@@ -27,6 +27,9 @@ struct Rice {
     static int32_t read_sint(BitReader& br, uint32_t k){
         return unzigzag(read_uint(br, k));
     }
+    // code lengths, for bit-cost estimation without writing
+    static uint32_t uint_bits(uint32_t v, uint32_t k){ return (v >> k) + 1 + k; }
+    static uint32_t sint_bits(int32_t x, uint32_t k){ return uint_bits(zigzag(x), k); }
 };
 
 } // namespace wofl
@@ -0,0 +1,137 @@
+#pragma once
+#include <vector>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+#include "bitio.hpp"
+#include "rice.hpp"
+#include "psy.hpp"
+#include "pns.hpp"
+
+namespace wofl {
+
+// Bandwidth extension: the encoder codes tracks and residual only below a
+// crossover frequency and sends a coarse energy envelope of the band
+// above it. The decoder rebuilds the high band by copying up the octave
+// under the crossover from its own decoded spectrum and scales each
+// envelope band to the sent energy.
+
+// crossovers closer to DC leave too little low band to copy up
+constexpr uint32_t SBR_MIN_HZ = 1000;
+// envelope bands narrower than this are merged into the next one
+constexpr int SBR_MIN_WIDTH = 4;
+// Rice parameter of the per-band level change from the previous frame
+constexpr uint32_t SBR_DELTA_K = 0;
+// lowest envelope level (about -84 dB mean power per bin, 16-bit noise
+// floor territory); bands at it are left silent
+constexpr int SBR_FLOOR = -28;
+// a band keeps its previous level while within this many steps of it, so
+// levels near a rounding boundary do not flicker
+constexpr float SBR_HOLD = 0.75f;
+
+// crossover as a bin index of an n-bin spectrum covering [0, sr/2)
+inline size_t sbr_bin(uint32_t hz, size_t n, int sr) {
+    return (size_t)std::lround(double(hz) * 2.0 * double(n) / double(sr));
+}
+
+// Envelope bands of an hop-bin MDCT: Bark bands from the crossover bin up,
+// the first starting exactly at the crossover.
+struct SbrBands {
+    int cross = 0;
+    std::vector<int> bands;
+
+    SbrBands() = default;
+    SbrBands(size_t hop, int sr, uint32_t hz) {
+        cross = (int)sbr_bin(hz, hop, sr);
+        if (cross < 2 * SBR_MIN_WIDTH || cross >= (int)hop) throw std::runtime_error("bad bandwidth extension crossover");
+        std::vector<int> bark;
+        bark_band_edges(2 * (int)hop, sr, bark);
+        bands.assign(1, cross);
+        for (int e : bark)
+            if (e - bands.back() >= SBR_MIN_WIDTH && (int)hop - e >= SBR_MIN_WIDTH) bands.push_back(e);
+        bands.push_back((int)hop);
+    }
+
+    size_t size() const { return bands.size() - 1; }
+};
+
+// Envelope of the input block's MDCT X: each band's mean power as a level
+// in 3 dB steps (2^level), not below SBR_FLOOR. SbrEnvelopes rounds it;
+// the patch only has to get the spectral tilt right, so this is coarser
+// than the noise energies.
+inline void sbr_envelope(const std::vector<float> &X, const SbrBands &sb, std::vector<float> &pw,
+                         std::vector<double> &prefix, std::vector<float> &e, std::vector<float> &env) {
+    power_of(X, pw);
+    power_prefix(pw, prefix);
+    band_energy(prefix, sb.bands, e);
+    env.resize(e.size());
+    for (size_t b = 0; b < e.size(); ++b)
+        env[b] = std::max(float(SBR_FLOOR), std::log2(e[b] / float(sb.bands[b + 1] - sb.bands[b])));
+}
+
+// Envelopes are sent per channel as one bit when nothing changed since the
+// previous frame of the segment, else as each band's change; levels start
+// at SBR_FLOOR in every segment.
+struct SbrEnvelopes {
+    std::vector<std::vector<int>> prev; // [channel][band]
+    std::vector<int> q;
+
+    SbrEnvelopes() = default;
+    SbrEnvelopes(size_t ch, size_t nbands) : prev(ch, std::vector<int>(nbands, SBR_FLOOR)) {}
+
+    // levels as made by sbr_envelope
+    void write(BitWriter &bw, size_t c, const std::vector<float> &env) {
+        q.resize(env.size());
+        for (size_t b = 0; b < env.size(); ++b)
+            q[b] = std::fabs(env[b] - float(prev[c][b])) <= SBR_HOLD ? prev[c][b] : (int)std::lround(env[b]);
+        bool same = q == prev[c];
+        bw.put_bit(!same);
+        if (same) return;
+        for (size_t b = 0; b < q.size(); ++b) Rice::write_sint(bw, q[b] - prev[c][b], SBR_DELTA_K);
+        prev[c] = q;
+    }
+
+    void read(BitReader &br, size_t c, std::vector<int> &env) {
+        env.resize(prev[c].size());
+        if (!br.get_bit()) {
+            env = prev[c];
+            return;
+        }
+        for (size_t b = 0; b < env.size(); ++b) {
+            env[b] = prev[c][b] + Rice::read_sint(br, SBR_DELTA_K);
+            if (env[b] < SBR_FLOOR || env[b] > 100) throw std::runtime_error("bad envelope level");
+            prev[c][b] = env[b];
+        }
+    }
+};
+
+// Rebuild bins [cross, hop) of decoded spectrum Y from the octave below the
+// crossover, repeated as often as needed, and scale every envelope band to
+// its coded mean power; bands at SBR_FLOOR stay silent. A band whose
+// copied source is silent gets noise from the PNS generator instead.
+inline void sbr_patch(std::vector<float> &Y, const SbrBands &sb, const std::vector<int> &env, uint32_t seed) {
+    const int lo = sb.cross / 2, w = sb.cross - lo;
+    for (int k = sb.cross; k < sb.bands.back(); ++k) Y[k] = Y[lo + (k - sb.cross) % w];
+    for (size_t b = 0; b < sb.size(); ++b) {
+        int a = sb.bands[b], z = sb.bands[b + 1];
+        if (env[b] <= SBR_FLOOR) {
+            std::fill(Y.begin() + a, Y.begin() + z, 0.0f);
+            continue;
+        }
+        float e = 0.0f;
+        for (int k = a; k < z; ++k) e += Y[k] * Y[k];
+        if (e <= 1e-20f) {
+            e = 0.0f;
+            for (int k = a; k < z; ++k) {
+                Y[k] = noise_at(seed, uint32_t(k));
+                e += Y[k] * Y[k];
+            }
+        }
+        float target = float(z - a) * std::exp2(float(env[b]));
+        float g = e > 0.0f ? std::sqrt(target / e) : 0.0f;
+        for (int k = a; k < z; ++k) Y[k] *= g;
+    }
+}
+
+} // namespace wofl
@@ -0,0 +1,62 @@
+#pragma once
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <cstddef>
+
+namespace wofl {
+
+// Bounded lock-free single-producer/single-consumer ring buffer.
+// Capacity is rounded up to a power of two; head and tail live on
+// separate cache lines so producer and consumer don't false-share.
+template <typename T>
+class SpscQueue {
+    std::vector<T> slots;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head{0}; // next slot to pop (consumer)
+    alignas(64) std::atomic<size_t> tail{0}; // next slot to push (producer)
+
+    static size_t round_pow2(size_t n) {
+        size_t c = 1;
+        while (c < n) c <<= 1;
+        return c;
+    }
+
+public:
+    explicit SpscQueue(size_t capacity)
+        : slots(round_pow2(capacity ? capacity : 1)), mask(slots.size() - 1) {}
+
+    SpscQueue(const SpscQueue&) = delete;
+    SpscQueue& operator=(const SpscQueue&) = delete;
+
+    size_t capacity() const { return slots.size(); }
+
+    bool try_push(const T &v) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == slots.size()) return false;
+        slots[t & mask] = v;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool try_pop(T &v) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        v = slots[h & mask];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    // spinning variants; yield while the ring is full/empty
+    void push(const T &v) {
+        while (!try_push(v)) std::this_thread::yield();
+    }
+
+    T pop() {
+        T v;
+        while (!try_pop(v)) std::this_thread::yield();
+        return v;
+    }
+};
+
+} // namespace wofl
@@ -0,0 +1,150 @@
+#pragma once
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <algorithm>
+#include <utility>
+
+namespace wofl {
+
+// Work-stealing pool: every worker owns a deque. Tasks submitted from a
+// worker go to the back of its own deque and are popped LIFO (cache-hot),
+// tasks from outside are dealt round-robin, and idle workers steal from
+// the front of the other deques. The first exception thrown by a task is
+// rethrown from wait().
+class ThreadPool {
+    struct Queue {
+        std::mutex m;
+        std::deque<std::function<void()>> tasks;
+    };
+
+    std::vector<std::unique_ptr<Queue>> queues;
+    std::vector<std::thread> workers;
+    std::mutex mtx;
+    std::condition_variable cv_task;
+    std::condition_variable cv_done;
+    std::atomic<size_t> queued{0};  // tasks sitting in deques
+    std::atomic<size_t> pending{0}; // tasks submitted but not finished
+    std::atomic<size_t> next{0};    // round-robin cursor for outside submits
+    bool stopping = false;
+    std::exception_ptr error;
+
+    // (pool, index) of the calling thread if it is a worker
+    static std::pair<const ThreadPool*, int> &self() {
+        static thread_local std::pair<const ThreadPool*, int> s{nullptr, -1};
+        return s;
+    }
+
+    bool pop_local(size_t i, std::function<void()> &task) {
+        Queue &q = *queues[i];
+        std::lock_guard<std::mutex> lock(q.m);
+        if (q.tasks.empty()) return false;
+        task = std::move(q.tasks.back());
+        q.tasks.pop_back();
+        return true;
+    }
+
+    bool steal(size_t i, std::function<void()> &task) {
+        for (size_t k = 1; k < queues.size(); ++k) {
+            Queue &q = *queues[(i + k) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.m);
+            if (q.tasks.empty()) continue;
+            task = std::move(q.tasks.front());
+            q.tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    void run(size_t i) {
+        self() = {this, (int)i};
+        for (;;) {
+            std::function<void()> task;
+            if (pop_local(i, task) || steal(i, task)) {
+                queued--;
+                try {
+                    task();
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    if (!error) error = std::current_exception();
+                }
+                if (--pending == 0) {
+                    std::lock_guard<std::mutex> lock(mtx);
+                    cv_done.notify_all();
+                }
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mtx);
+            cv_task.wait(lock, [&]{ return stopping || queued > 0; });
+            if (stopping && queued == 0) return;
+        }
+    }
+
+public:
+    // nthreads == 0 picks the hardware concurrency
+    explicit ThreadPool(unsigned nthreads = 0) {
+        if (nthreads == 0) nthreads = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned i = 0; i < nthreads; ++i) queues.emplace_back(new Queue);
+        workers.reserve(nthreads);
+        for (unsigned i = 0; i < nthreads; ++i) workers.emplace_back([this, i]{ run(i); });
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx);
+            stopping = true;
+        }
+        cv_task.notify_all();
+        for (auto &t : workers) t.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    size_t size() const { return workers.size(); }
+
+    // index of the calling worker thread, or -1 outside the pool;
+    // lets tasks pick per-thread scratch buffers
+    int worker_index() const {
+        return self().first == this ? self().second : -1;
+    }
+
+    void submit(std::function<void()> task) {
+        int w = worker_index();
+        size_t i = w >= 0 ? (size_t)w : next++ % queues.size();
+        pending++;
+        queued++;
+        {
+            std::lock_guard<std::mutex> lock(queues[i]->m);
+            queues[i]->tasks.push_back(std::move(task));
+        }
+        std::lock_guard<std::mutex> lock(mtx);
+        cv_task.notify_one();
+    }
+
+    // block until every submitted task (including ones submitted by tasks)
+    // has finished; must not be called from a worker
+    void wait() {
+        std::unique_lock<std::mutex> lock(mtx);
+        cv_done.wait(lock, [&]{ return pending == 0; });
+        if (error) {
+            std::exception_ptr e = error;
+            error = nullptr;
+            std::rethrow_exception(e);
+        }
+    }
+};
+
+// run fn(i) for i in [0, n) on the pool and wait for completion
+inline void parallel_for(ThreadPool &pool, size_t n, const std::function<void(size_t)> &fn) {
+    for (size_t i = 0; i < n; ++i) pool.submit([&fn, i]{ fn(i); });
+    pool.wait();
+}
+
+} // namespace wofl
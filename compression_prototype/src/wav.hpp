@@ -1,131 +1,563 @@
 #pragma once
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <vector>
 #include <string>
 #include <stdexcept>
 #include <algorithm>
 #include <cmath>
+#include <memory>
+#include "limiter.hpp"
 
 namespace wofl {
 
+// Sample encoding of a WAV data chunk: 8-bit (unsigned), 16, 24 or 32-bit
+// PCM, or 32/64-bit IEEE float.
+struct PcmFormat {
+    uint16_t bits = 16;
+    bool is_float = false;
+
+    size_t bytes() const { return bits / 8; }
+
+    bool valid() const {
+        return is_float ? bits == 32 || bits == 64 : bits == 8 || bits == 16 || bits == 24 || bits == 32;
+    }
+};
+
+// "8", "16", "24", "32", "f32" or "f64"
+inline PcmFormat parse_pcm_format(const std::string& s) {
+    PcmFormat f;
+    f.is_float = !s.empty() && s[0] == 'f';
+    f.bits = static_cast<uint16_t>(std::stoul(s.substr(f.is_float ? 1 : 0)));
+    if (!f.valid()) throw std::runtime_error("unsupported sample format " + s);
+    return f;
+}
+
 struct WavData {
     int sample_rate = 44100;
     int channels = 1;
-    std::vector<float> samples; // normalized to [-1,1]
+    uint32_t channel_mask = 0;  // WAVE_FORMAT_EXTENSIBLE speaker bits, 0 = unspecified
+    PcmFormat format;           // of the file's data chunk
+    std::vector<float> samples; // interleaved, normalized to [-1,1]
+};
+
+// ---- Sample conversion kernels ----
+// Straight loops over packed little-endian samples with no branches on the
+// data, so the compiler vectorises them. Integer PCM maps to [-1, 1) by
+// 2^(bits-1) (8-bit is offset by 128); float PCM is taken as is.
+inline void pcm_to_float(const uint8_t* src, size_t n, PcmFormat fmt, float* dst) {
+    if (fmt.is_float && fmt.bits == 32) {
+        std::memcpy(dst, src, n * 4);
+    } else if (fmt.is_float) {
+        for (size_t i=0;i<n;++i) {
+            double v; std::memcpy(&v, src + 8*i, 8);
+            dst[i]=static_cast<float>(v);
+        }
+    } else if (fmt.bits == 8) {
+        for (size_t i=0;i<n;++i) dst[i]=(float(src[i])-128.0f)*(1.0f/128.0f);
+    } else if (fmt.bits == 16) {
+        for (size_t i=0;i<n;++i) {
+            int16_t v; std::memcpy(&v, src + 2*i, 2);
+            dst[i]=float(v)*(1.0f/32768.0f);
+        }
+    } else if (fmt.bits == 24) {
+        for (size_t i=0;i<n;++i) {
+            // assemble in the top three bytes, then sign-extend by the shift
+            uint32_t u=uint32_t(src[3*i])<<8 | uint32_t(src[3*i+1])<<16 | uint32_t(src[3*i+2])<<24;
+            dst[i]=float(static_cast<int32_t>(u)>>8)*(1.0f/8388608.0f);
+        }
+    } else {
+        for (size_t i=0;i<n;++i) {
+            int32_t v; std::memcpy(&v, src + 4*i, 4);
+            dst[i]=float(v)*(1.0f/2147483648.0f);
+        }
+    }
+}
+
+// n floats to format fmt at dst; integer PCM is rounded to nearest and
+// clipped to its range.
+inline void float_to_pcm(const float* src, size_t n, PcmFormat fmt, uint8_t* dst) {
+    if (fmt.is_float && fmt.bits == 32) {
+        std::memcpy(dst, src, n * 4);
+    } else if (fmt.is_float) {
+        for (size_t i=0;i<n;++i) {
+            double v=src[i];
+            std::memcpy(dst + 8*i, &v, 8);
+        }
+    } else if (fmt.bits == 32) {
+        // float cannot hold 2^31 - 1, so clip in double
+        for (size_t i=0;i<n;++i) {
+            double v=std::min(2147483647.0, std::max(-2147483648.0, double(src[i])*2147483648.0));
+            int32_t s=static_cast<int32_t>(v + (v < 0.0 ? -0.5 : 0.5));
+            std::memcpy(dst + 4*i, &s, 4);
+        }
+    } else {
+        const float scale=float(1u << (fmt.bits-1));
+        auto quant=[scale](float x) {
+            float v=std::min(scale-1.0f, std::max(-scale, x*scale));
+            return static_cast<int32_t>(v + (v < 0.0f ? -0.5f : 0.5f));
+        };
+        if (fmt.bits == 8) {
+            for (size_t i=0;i<n;++i) dst[i]=static_cast<uint8_t>(quant(src[i]) + 128);
+        } else if (fmt.bits == 16) {
+            for (size_t i=0;i<n;++i) {
+                int16_t h=static_cast<int16_t>(quant(src[i]));
+                std::memcpy(dst + 2*i, &h, 2);
+            }
+        } else {
+            for (size_t i=0;i<n;++i) {
+                int32_t v=quant(src[i]);
+                dst[3*i]=static_cast<uint8_t>(v);
+                dst[3*i+1]=static_cast<uint8_t>(v >> 8);
+                dst[3*i+2]=static_cast<uint8_t>(v >> 16);
+            }
+        }
+    }
+}
+
+// largest |x| of n samples, in eight lanes so the loop vectorises
+inline float peak_abs(const float* x, size_t n) {
+    float lane[8] = {};
+    const size_t m = n - n % 8;
+    for (size_t i=0;i<m;i+=8)
+        for (size_t j=0;j<8;++j) lane[j]=std::max(lane[j], std::fabs(x[i+j]));
+    for (size_t j=0;j<n-m;++j) lane[j]=std::max(lane[j], std::fabs(x[m+j]));
+    return *std::max_element(lane, lane+8);
+}
+
+// ---- Streaming WAV writer ----
+// Writes the header with placeholder sizes, converts samples as they come
+// and patches the sizes on close(). The header reserves a JUNK chunk the
+// size of a ds64 chunk: a file whose RIFF size overflows 32 bits is turned
+// into RF64 on close, with the 64-bit sizes in the ds64 chunk and the
+// 32-bit fields set to 0xFFFFFFFF. More than two channels, a speaker mask
+// or integer samples wider than 16 bits are written as
+// WAVE_FORMAT_EXTENSIBLE so players get the layout and depth; plain float
+// files carry the fact chunk non-PCM formats need.
+// Samples go through an optional gain and peak limiter, are converted a
+// block at a time into a staging buffer, and reach the file in STAGING-byte
+// writes.
+class WavWriter {
+    std::ofstream out;
+    int channels_;
+    PcmFormat fmt_;
+    uint64_t data_bytes = 0;
+    std::streamoff ds64_pos = 0, fact_pos = 0, data_pos = 0;
+    float gain_ = 1.0f;
+    std::unique_ptr<PeakLimiter> limiter;
+    std::vector<float> work; // block after gain and limiter
+    std::vector<uint8_t> staging;
+    size_t staged = 0;
+
+    template <typename T>
+    void put(T v) { out.write(reinterpret_cast<const char*>(&v), sizeof(T)); }
+
+    void flush_staging() {
+        out.write(reinterpret_cast<const char*>(staging.data()), staged);
+        staged = 0;
+    }
+
+    // n interleaved samples, n <= BLOCK
+    void stage(const float* pcm, size_t n) {
+        const size_t bytes = n * fmt_.bytes();
+        if (staged + bytes > staging.size()) flush_staging();
+        float_to_pcm(pcm, n, fmt_, staging.data() + staged);
+        staged += bytes;
+        data_bytes += bytes;
+    }
+
+    // m whole frames of interleaved samples, m * channels <= BLOCK
+    void put_block(const float* pcm, size_t m) {
+        const size_t ch = channels_;
+        if (gain_ == 1.0f && !limiter) {
+            stage(pcm, m * ch);
+            return;
+        }
+        work.resize(m * ch);
+        for (size_t i = 0; i < m * ch; ++i) work[i] = pcm[i] * gain_;
+        if (limiter) m = limiter->process(work.data(), m, work.data());
+        stage(work.data(), m * ch);
+    }
+
+public:
+    static constexpr size_t BLOCK = 16384;      // samples converted at a time
+    static constexpr size_t STAGING = 1u << 20; // bytes per file write
+
+    WavWriter(const std::string& path, int sample_rate, int channels, uint32_t channel_mask = 0,
+              PcmFormat fmt = {})
+        : out(path, std::ios::binary), channels_(channels), fmt_(fmt), staging(STAGING) {
+        if (!fmt.valid()) throw std::runtime_error("unsupported wav sample format");
+        if (channels <= 0 || channels > 0xFFFF) throw std::runtime_error("unsupported wav channel count");
+        if (!out) throw std::runtime_error("cannot open wav for writing");
+
+        bool extensible = channels > 2 || channel_mask != 0 || (!fmt.is_float && fmt.bits > 16);
+        uint32_t fmt_size = extensible ? 40 : fmt.is_float ? 18 : 16;
+        uint16_t audio_fmt = extensible ? 0xFFFE : fmt.is_float ? 3 : 1;
+        uint16_t block_align = static_cast<uint16_t>(channels * fmt.bytes());
+
+        out.write("RIFF", 4);
+        put<uint32_t>(0);
+        out.write("WAVE", 4);
+
+        // room for ds64: RIFF and data sizes, sample count, empty table
+        ds64_pos = out.tellp();
+        out.write("JUNK", 4);
+        put<uint32_t>(28);
+        for (int i = 0; i < 28; ++i) out.put(0);
+
+        out.write("fmt ", 4);
+        put<uint32_t>(fmt_size);
+        put<uint16_t>(audio_fmt);
+        put<uint16_t>(static_cast<uint16_t>(channels));
+        put<uint32_t>(static_cast<uint32_t>(sample_rate));
+        put<uint32_t>(static_cast<uint32_t>(sample_rate) * block_align);
+        put<uint16_t>(block_align);
+        put<uint16_t>(fmt.bits);
+        if (extensible) {
+            // cbSize, valid bits, channel mask, KSDATAFORMAT_SUBTYPE_PCM or
+            // _IEEE_FLOAT (the GUIDs differ in the first byte only)
+            uint8_t guid[16] = {0x01,0x00,0x00,0x00,0x00,0x00,0x10,0x00,
+                                0x80,0x00,0x00,0xAA,0x00,0x38,0x9B,0x71};
+            if (fmt.is_float) guid[0] = 0x03;
+            put<uint16_t>(22);
+            put<uint16_t>(fmt.bits);
+            put<uint32_t>(channel_mask);
+            out.write(reinterpret_cast<const char*>(guid), 16);
+        } else if (fmt.is_float) {
+            put<uint16_t>(0);
+        }
+        if (fmt.is_float && !extensible) {
+            out.write("fact", 4);
+            put<uint32_t>(4);
+            fact_pos = out.tellp();
+            put<uint32_t>(0);
+        }
+
+        out.write("data", 4);
+        data_pos = out.tellp();
+        put<uint32_t>(0);
+    }
+
+    ~WavWriter() {
+        try { close(); } catch (...) {}
+    }
+
+    WavWriter(const WavWriter&) = delete;
+    WavWriter& operator=(const WavWriter&) = delete;
+
+    // scale every sample written from now on
+    void set_gain(float g) { gain_ = g; }
+
+    // limit the (scaled) output to ceiling on the fly with a look-ahead
+    // PeakLimiter; set before the first write
+    void set_limiter(int sample_rate, float ceiling = 0.999f) {
+        limiter = std::make_unique<PeakLimiter>(channels_, sample_rate, ceiling);
+    }
+
+    // frames of interleaved samples
+    void write(const float* pcm, size_t frames) {
+        const size_t ch = channels_, step = std::max<size_t>(BLOCK / ch, 1);
+        for (size_t t = 0; t < frames; t += step) put_block(pcm + t * ch, std::min(step, frames - t));
+    }
+
+    // frames of deinterleaved samples, one plane per channel
+    void write(const std::vector<std::vector<float>>& planes, size_t frames) {
+        const size_t ch = channels_, step = std::max<size_t>(BLOCK / ch, 1);
+        std::vector<float> inter(std::min(step, frames) * ch);
+        for (size_t t = 0; t < frames; t += step) {
+            size_t m = std::min(step, frames - t);
+            for (size_t c = 0; c < ch; ++c)
+                for (size_t i = 0; i < m; ++i) inter[i * ch + c] = planes[c][t + i];
+            put_block(inter.data(), m);
+        }
+    }
+
+    uint64_t frames_written() const { return data_bytes / (fmt_.bytes() * channels_); }
+
+    // pad the data chunk and patch the sizes; further writes are an error
+    void close() {
+        if (!out.is_open()) return;
+        if (limiter) {
+            work.resize(limiter->latency() * channels_);
+            size_t m = limiter->flush(work.data());
+            const size_t n = m * channels_;
+            for (size_t i = 0; i < n; i += BLOCK) stage(work.data() + i, std::min(BLOCK, n - i));
+            limiter.reset();
+        }
+        flush_staging();
+        if (data_bytes & 1) out.put(0);
+        const uint64_t riff = uint64_t(out.tellp()) - 8;
+        const uint64_t frames = frames_written();
+        if (riff > 0xFFFFFFFFu) {
+            out.seekp(0);
+            out.write("RF64", 4);
+            put<uint32_t>(0xFFFFFFFFu);
+            out.seekp(ds64_pos);
+            out.write("ds64", 4);
+            put<uint32_t>(28);
+            put<uint64_t>(riff);
+            put<uint64_t>(data_bytes);
+            put<uint64_t>(frames);
+            put<uint32_t>(0);
+            out.seekp(data_pos);
+            put<uint32_t>(0xFFFFFFFFu);
+        } else {
+            out.seekp(4);
+            put<uint32_t>(static_cast<uint32_t>(riff));
+            out.seekp(data_pos);
+            put<uint32_t>(static_cast<uint32_t>(data_bytes));
+        }
+        if (fact_pos) {
+            out.seekp(fact_pos);
+            put<uint32_t>(static_cast<uint32_t>(std::min<uint64_t>(frames, 0xFFFFFFFFu)));
+        }
+        out.close();
+        if (!out) throw std::runtime_error("error writing wav");
+    }
 };
 
-// ---- WAV writing helper ----
+// Float samples written at unit gain in format fmt.
 inline void write_wav(const std::string& path,
-                      const std::vector<int16_t>& data,
+                      const std::vector<float>& pcm,
                       int sample_rate,
-                      int channels) {
-    std::ofstream out(path, std::ios::binary);
-    if (!out) throw std::runtime_error("cannot open wav for writing");
-
-    uint32_t data_bytes = static_cast<uint32_t>(data.size() * sizeof(int16_t));
-    uint32_t fmt_size = 16;
-    uint16_t audio_fmt = 1; // PCM
-    uint16_t num_channels = static_cast<uint16_t>(channels);
-    uint32_t byte_rate = sample_rate * num_channels * sizeof(int16_t);
-    uint16_t block_align = num_channels * sizeof(int16_t);
-    uint16_t bits_per_sample = 16;
-
-    // RIFF header
-    out.write("RIFF", 4);
-    uint32_t chunk_size = 36 + data_bytes;
-    out.write(reinterpret_cast<const char*>(&chunk_size), 4);
-    out.write("WAVE", 4);
-
-    // fmt chunk
-    out.write("fmt ", 4);
-    out.write(reinterpret_cast<const char*>(&fmt_size), 4);
-    out.write(reinterpret_cast<const char*>(&audio_fmt), 2);
-    out.write(reinterpret_cast<const char*>(&num_channels), 2);
-    out.write(reinterpret_cast<const char*>(&sample_rate), 4);
-    out.write(reinterpret_cast<const char*>(&byte_rate), 4);
-    out.write(reinterpret_cast<const char*>(&block_align), 2);
-    out.write(reinterpret_cast<const char*>(&bits_per_sample), 2);
-
-    // data chunk
-    out.write("data", 4);
-    out.write(reinterpret_cast<const char*>(&data_bytes), 4);
-    out.write(reinterpret_cast<const char*>(data.data()), data_bytes);
+                      int channels,
+                      uint32_t channel_mask = 0,
+                      PcmFormat fmt = {}) {
+    WavWriter w(path, sample_rate, channels, channel_mask, fmt);
+    w.write(pcm.data(), pcm.size() / channels);
+    w.close();
 }
 
-// ---- WAV reading helper ----
-inline WavData read_wav(const std::string& path) {
-    std::ifstream in(path, std::ios::binary);
-    if (!in) throw std::runtime_error("cannot open wav for reading");
-
-    char riff[4]; in.read(riff, 4);
-    if (std::string(riff,4)!="RIFF") throw std::runtime_error("bad wav (no RIFF)");
-    in.ignore(4);
-    char wave[4]; in.read(wave,4);
-    if (std::string(wave,4)!="WAVE") throw std::runtime_error("bad wav (no WAVE)");
-
-    int sample_rate=0, channels=0, bits=0;
-    uint32_t data_bytes=0;
-    std::streampos data_pos=0;
-
-    while (in) {
-        char id[4]; in.read(id,4);
-        uint32_t sz=0; in.read(reinterpret_cast<char*>(&sz),4);
-        if (!in) break;
-        std::string chunk(id,4);
-        if (chunk=="fmt ") {
-            uint16_t fmt=0; in.read(reinterpret_cast<char*>(&fmt),2);
-            uint16_t chn=0; in.read(reinterpret_cast<char*>(&chn),2); channels=chn;
-            uint32_t sr=0; in.read(reinterpret_cast<char*>(&sr),4); sample_rate=sr;
-            uint32_t byte_rate; in.read(reinterpret_cast<char*>(&byte_rate),4);
-            uint16_t block_align; in.read(reinterpret_cast<char*>(&block_align),2);
-            uint16_t bps=0; in.read(reinterpret_cast<char*>(&bps),2); bits=bps;
-            in.ignore(sz-16);
-        } else if (chunk=="data") {
-            data_bytes=sz;
-            data_pos=in.tellg();
-            in.seekg(sz,std::ios::cur);
+// ---- WAV header parsing ----
+// What the chunks ahead of the data chunk say about it. Readers hand each
+// fmt and ds64 chunk (its first 40 bytes at most) to parse(), then ask
+// data_frames() about the data chunk's declared size.
+struct WavLayout {
+    static constexpr uint64_t UNKNOWN_FRAMES = ~uint64_t(0);
+
+    int sample_rate = 0, channels = 0;
+    uint32_t channel_mask = 0;
+    PcmFormat format{0, false};
+    uint16_t tag = 0; // format tag, the subtype's for WAVE_FORMAT_EXTENSIBLE
+    bool have_fmt = false, have_ds64 = false;
+    uint64_t data64 = 0; // data size from ds64
+
+    size_t frame_bytes() const { return format.bytes() * channels; }
+
+    // RIFF, RF64 or BW64 header of 12 bytes
+    static void check_riff(const char* p) {
+        std::string kind(p, 4);
+        if (kind!="RIFF" && kind!="RF64" && kind!="BW64") throw std::runtime_error("bad wav (no RIFF)");
+        if (std::string(p+8,4)!="WAVE") throw std::runtime_error("bad wav (no WAVE)");
+    }
+
+    // chunk id with size sz, of which n bytes are at p; true if it is one
+    // of the chunks parsed here
+    bool parse(const std::string& id, uint32_t sz, const uint8_t* p, size_t n) {
+        auto u16 = [&](size_t o) { uint16_t v; std::memcpy(&v, p+o, 2); return v; };
+        auto u32 = [&](size_t o) { uint32_t v; std::memcpy(&v, p+o, 4); return v; };
+        if (id=="ds64") {
+            if (sz<24 || n<16) throw std::runtime_error("bad wav (short ds64 chunk)");
+            std::memcpy(&data64, p+8, 8); // after the RIFF size
+            have_ds64=true;
+        } else if (id=="fmt ") {
+            if (sz<16 || n<16) throw std::runtime_error("bad wav (short fmt chunk)");
+            tag=u16(0);
+            channels=u16(2);
+            sample_rate=static_cast<int>(u32(4));
+            format.bits=u16(14); // after byte rate and block align
+            if (tag==0xFFFE && sz>=40 && n>=40) {
+                channel_mask=u32(20); // after cbSize and valid bits
+                tag=u16(24);          // subtype GUID, led by its format tag
+            }
+            format.is_float = tag==3;
+            have_fmt=true;
         } else {
-            in.seekg(sz,std::ios::cur);
+            return false;
         }
+        return true;
+    }
+
+    // frames in a data chunk declaring sz bytes; UNKNOWN_FRAMES for 0 or
+    // 0xFFFFFFFF without ds64. Throws if the format is not supported.
+    uint64_t data_frames(uint32_t sz) const {
+        if (!have_fmt) throw std::runtime_error("bad wav (data before fmt)");
+        if ((tag!=1 && tag!=3) || !format.valid())
+            throw std::runtime_error("unsupported wav format (tag " + std::to_string(tag) + ", " +
+                                     std::to_string(format.bits) + " bits)");
+        if (channels<=0) throw std::runtime_error("bad wav (no channels)");
+        if (sz==0xFFFFFFFFu && have_ds64) return data64/frame_bytes();
+        if (sz==0 || sz==0xFFFFFFFFu) return UNKNOWN_FRAMES;
+        return sz/frame_bytes();
     }
+};
 
-    if (bits!=16) throw std::runtime_error("only 16-bit PCM supported");
+// ---- Streaming WAV reader ----
+// PCM (format tag 1), IEEE float (3) or WAVE_FORMAT_EXTENSIBLE with either
+// subtype, in any of the PcmFormat depths, from RIFF, RF64 or BW64 files.
+// The header is parsed up to the data chunk, which is then read a block
+// at a time. A data size of 0 or 0xFFFFFFFF without a ds64 chunk (a
+// capture that never patched its header) is read up to the end of file.
+class WavReader {
+    std::ifstream in;
+    WavLayout layout;
+    uint64_t frames_ = 0;     // in the data chunk, UNKNOWN_FRAMES = up to EOF
+    uint64_t remaining = 0;   // frames still to read
+    std::vector<uint8_t> raw;
+    std::vector<float> inter;
 
-    in.clear();
-    in.seekg(data_pos);
+public:
+    static constexpr uint64_t UNKNOWN_FRAMES = WavLayout::UNKNOWN_FRAMES;
+    static constexpr size_t BLOCK = 16384; // samples converted per read
 
-    std::vector<int16_t> raw(data_bytes/2);
-    in.read(reinterpret_cast<char*>(raw.data()),data_bytes);
+    explicit WavReader(const std::string& path) : in(path, std::ios::binary) {
+        if (!in) throw std::runtime_error("cannot open wav for reading");
 
-    WavData out;
-    out.sample_rate=sample_rate;
-    out.channels=channels;
-    out.samples.resize(raw.size());
-    for (size_t i=0;i<raw.size();++i) {
-        out.samples[i]=raw[i]/32768.0f;
+        char riff[12]; in.read(riff, 12);
+        if (!in) throw std::runtime_error("bad wav (no RIFF)");
+        WavLayout::check_riff(riff);
+
+        for (;;) {
+            char id[4]; in.read(id,4);
+            uint32_t sz=0; in.read(reinterpret_cast<char*>(&sz),4);
+            if (!in) throw std::runtime_error("bad wav (no data chunk)");
+            std::string chunk(id,4);
+            uint64_t padded=uint64_t(sz)+(sz&1); // chunks are word aligned
+            if (chunk=="data") {
+                frames_=remaining=layout.data_frames(sz);
+                return;
+            }
+            uint8_t head[40];
+            size_t n=0;
+            if (chunk=="fmt " || chunk=="ds64") {
+                n=size_t(std::min<uint64_t>(padded, sizeof(head)));
+                in.read(reinterpret_cast<char*>(head), n);
+                layout.parse(chunk, sz, head, size_t(in.gcount()));
+            }
+            in.ignore(std::streamsize(padded-n)); // read past rather than seek, so pipes work
+        }
+    }
+
+    int sample_rate() const { return layout.sample_rate; }
+    int channels() const { return layout.channels; }
+    uint32_t channel_mask() const { return layout.channel_mask; }
+    PcmFormat format() const { return layout.format; }
+    uint64_t frames() const { return frames_; }
+
+    // up to `frames` frames of interleaved samples; returns how many were
+    // read, short only at the end of the data (a truncated file included)
+    size_t read(float* dst, size_t frames) {
+        const size_t ch = layout.channels, width = layout.format.bytes();
+        size_t want = size_t(std::min<uint64_t>(frames, remaining)) * ch, done = 0;
+        raw.resize(std::min(want, BLOCK) * width);
+        while (done < want) {
+            size_t n = std::min(BLOCK, want - done);
+            in.read(reinterpret_cast<char*>(raw.data()), n * width);
+            n = static_cast<size_t>(in.gcount()) / width;
+            pcm_to_float(raw.data(), n, layout.format, dst + done);
+            done += n;
+            if (!in) break;
+        }
+        size_t got = done / ch;
+        if (got < want / ch) remaining = 0; // end of file, a partial frame dropped
+        else if (remaining != UNKNOWN_FRAMES) remaining -= got;
+        return got;
     }
+
+    // up to `frames` frames deinterleaved into one plane per channel, each
+    // resized to the frames read
+    size_t read(std::vector<std::vector<float>>& planes, size_t frames) {
+        const size_t ch = layout.channels;
+        inter.resize(frames * ch);
+        size_t got = read(inter.data(), frames);
+        planes.resize(ch);
+        for (size_t c = 0; c < ch; ++c) {
+            planes[c].resize(got);
+            for (size_t i = 0; i < got; ++i) planes[c][i] = inter[i * ch + c];
+        }
+        return got;
+    }
+
+    // everything left, interleaved
+    std::vector<float> read_all() {
+        std::vector<float> pcm;
+        if (remaining != UNKNOWN_FRAMES) {
+            pcm.resize(size_t(remaining) * layout.channels);
+            pcm.resize(read(pcm.data(), size_t(remaining)) * layout.channels);
+            return pcm;
+        }
+        const size_t block = BLOCK / layout.channels + 1;
+        for (size_t got = block; got == block;) {
+            size_t at = pcm.size();
+            pcm.resize(at + block * layout.channels);
+            got = read(pcm.data() + at, block);
+            pcm.resize(at + got * layout.channels);
+        }
+        return pcm;
+    }
+
+    // everything left, one plane per channel, read a block at a time
+    std::vector<std::vector<float>> read_planes() {
+        const size_t ch = layout.channels, block = BLOCK / ch + 1;
+        std::vector<std::vector<float>> planes(ch);
+        if (remaining != UNKNOWN_FRAMES)
+            for (auto& p : planes) p.reserve(size_t(remaining));
+        inter.resize(block * ch);
+        for (size_t got = block; got == block;) {
+            got = read(inter.data(), block);
+            const size_t at = planes[0].size();
+            for (size_t c = 0; c < ch; ++c) {
+                planes[c].resize(at + got);
+                for (size_t i = 0; i < got; ++i) planes[c][at + i] = inter[i * ch + c];
+            }
+        }
+        return planes;
+    }
+};
+
+inline WavData read_wav(const std::string& path) {
+    WavReader r(path);
+    WavData out;
+    out.sample_rate=r.sample_rate();
+    out.channels=r.channels();
+    out.channel_mask=r.channel_mask();
+    out.format=r.format();
+    out.samples=r.read_all();
     return out;
 }
 
 // ---- Normalize + write float samples safely ----
+// Scales the file's peak to 0.999. The gain is applied block by block as
+// the samples are converted, so only the peak scan is an extra pass.
 inline void normalize_and_write(const std::vector<float>& pcm,
                                 const std::string& path,
                                 int sample_rate,
-                                int channels) {
-    float peak=0.0f;
-    for (auto f:pcm) peak=std::max(peak,std::fabs(f));
+                                int channels,
+                                uint32_t channel_mask = 0,
+                                PcmFormat fmt = {}) {
+    float peak=peak_abs(pcm.data(), pcm.size());
     if (peak<1e-12f) peak=1.0f;
-    float scale=0.999f/peak;
 
-    std::vector<int16_t> data(pcm.size());
-    for (size_t i=0;i<pcm.size();++i) {
-        float v=pcm[i]*scale*32767.0f;
-        if (v>32767.0f) v=32767.0f;
-        if (v<-32768.0f) v=-32768.0f;
-        data[i]=static_cast<int16_t>(std::lrint(v));
-    }
-    write_wav(path,data,sample_rate,channels);
+    WavWriter w(path, sample_rate, channels, channel_mask, fmt);
+    w.set_gain(0.999f/peak);
+    w.write(pcm.data(), pcm.size() / channels);
+    w.close();
+}
+
+// ---- Write float samples at unit gain through the peak limiter ----
+// The single-pass alternative to normalize_and_write: nothing is scanned
+// ahead, overs are pulled under 0.999 by the limiter as they stream out.
+inline void limit_and_write(const std::vector<float>& pcm,
+                            const std::string& path,
+                            int sample_rate,
+                            int channels,
+                            uint32_t channel_mask = 0,
+                            PcmFormat fmt = {}) {
+    WavWriter w(path, sample_rate, channels, channel_mask, fmt);
+    w.set_limiter(sample_rate);
+    w.write(pcm.data(), pcm.size() / channels);
+    w.close();
 }
 
 } // namespace wofl
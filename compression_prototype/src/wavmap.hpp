@@ -0,0 +1,210 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "wav.hpp"
+
+namespace wofl {
+
+// Read-only mapping of a whole file; empty files map to nothing.
+class MappedFile {
+    const uint8_t *base = nullptr;
+    size_t len = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE, mapping = nullptr;
+#endif
+
+public:
+    explicit MappedFile(const std::string &path) {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                           FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("cannot open wav for reading");
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(file, &size)) { CloseHandle(file); throw std::runtime_error("cannot stat wav"); }
+        len = size_t(size.QuadPart);
+        if (len) {
+            mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+            void *p = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+            if (!p) {
+                if (mapping) CloseHandle(mapping);
+                CloseHandle(file);
+                throw std::runtime_error("cannot map wav");
+            }
+            base = static_cast<const uint8_t *>(p);
+        }
+#else
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("cannot open wav for reading");
+        struct stat st;
+        if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+            ::close(fd);
+            throw std::runtime_error("cannot map wav (not a regular file)");
+        }
+        len = size_t(st.st_size);
+        if (len) {
+            void *p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (p == MAP_FAILED) {
+                ::close(fd);
+                throw std::runtime_error("cannot map wav");
+            }
+            madvise(p, len, MADV_SEQUENTIAL); // read ahead, drop behind
+            base = static_cast<const uint8_t *>(p);
+        }
+        ::close(fd); // the mapping keeps the file
+#endif
+    }
+
+    ~MappedFile() {
+#ifdef _WIN32
+        if (base) UnmapViewOfFile(base);
+        if (mapping) CloseHandle(mapping);
+        CloseHandle(file);
+#else
+        if (base) munmap(const_cast<uint8_t *>(base), len);
+#endif
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    const uint8_t *data() const { return base; }
+    size_t size() const { return len; }
+};
+
+// size samples of type T, stride bytes apart, read in place
+template <typename T>
+struct StridedView {
+    const uint8_t *base = nullptr;
+    size_t stride = 0;
+    size_t size = 0;
+
+    T operator[](size_t i) const {
+        T v;
+        std::memcpy(&v, base + i * stride, sizeof(T));
+        return v;
+    }
+};
+
+// WAV file read in place through a mapping: the chunk table is walked on
+// the mapped bytes and the samples never leave the page cache until a
+// block of them is converted to float. Takes the same files as WavReader;
+// a data chunk of unknown size runs to the end of the file, and one
+// declared past the end is cut to the whole frames present.
+class WavMap {
+    MappedFile file;
+    WavLayout layout;
+    const uint8_t *samples = nullptr; // data chunk
+    uint64_t frames_ = 0;
+    std::vector<float> buf; // last converted block
+
+public:
+    explicit WavMap(const std::string &path) : file(path) {
+        const uint8_t *p = file.data(), *end = p + file.size();
+        if (file.size() < 12) throw std::runtime_error("bad wav (no RIFF)");
+        WavLayout::check_riff(reinterpret_cast<const char *>(p));
+        for (p += 12;;) {
+            if (end - p < 8) throw std::runtime_error("bad wav (no data chunk)");
+            std::string id(reinterpret_cast<const char *>(p), 4);
+            uint32_t sz;
+            std::memcpy(&sz, p + 4, 4);
+            p += 8;
+            if (id == "data") {
+                frames_ = layout.data_frames(sz);
+                frames_ = std::min(frames_, uint64_t(end - p) / layout.frame_bytes());
+                samples = p;
+                return;
+            }
+            uint64_t padded = uint64_t(sz) + (sz & 1); // chunks are word aligned
+            layout.parse(id, sz, p, size_t(std::min<uint64_t>(padded, uint64_t(end - p))));
+            if (padded > uint64_t(end - p)) throw std::runtime_error("bad wav (no data chunk)");
+            p += padded;
+        }
+    }
+
+    int sample_rate() const { return layout.sample_rate; }
+    int channels() const { return layout.channels; }
+    uint32_t channel_mask() const { return layout.channel_mask; }
+    PcmFormat format() const { return layout.format; }
+    uint64_t frames() const { return frames_; }
+
+    // the packed data chunk, frames() * channels() samples
+    const uint8_t *data() const { return samples; }
+
+    // channel c in place as T, which must match the sample format
+    // (uint8_t, int16_t, int32_t, float or double; 24-bit has no view)
+    template <typename T>
+    StridedView<T> channel(int c) const {
+        const PcmFormat f = layout.format;
+        bool ok = sizeof(T) == f.bytes() && f.bits != 24 &&
+                  (std::is_floating_point<T>::value == f.is_float) &&
+                  (f.bits != 8 || std::is_unsigned<T>::value);
+        if (!ok || c < 0 || c >= layout.channels) throw std::runtime_error("sample view does not match the wav format");
+        return StridedView<T>{samples + size_t(c) * f.bytes(), layout.frame_bytes(), size_t(frames_)};
+    }
+
+    // frames [first, first + n) as interleaved float, converted now into a
+    // buffer the next call reuses; n is cut at the end of the data
+    const float *block(uint64_t first, size_t &n) {
+        first = std::min(first, frames_);
+        n = size_t(std::min<uint64_t>(n, frames_ - first));
+        const size_t ch = layout.channels;
+        buf.resize(n * ch);
+        pcm_to_float(samples + first * layout.frame_bytes(), n * ch, layout.format, buf.data());
+        return buf.data();
+    }
+
+    // the same block deinterleaved, one plane per channel resized to the
+    // frames converted; returns that count
+    size_t block(uint64_t first, size_t n, std::vector<std::vector<float>> &planes) {
+        const float *x = block(first, n);
+        const size_t ch = layout.channels;
+        planes.resize(ch);
+        for (size_t c = 0; c < ch; ++c) {
+            planes[c].resize(n);
+            for (size_t i = 0; i < n; ++i) planes[c][i] = x[i * ch + c];
+        }
+        return n;
+    }
+
+    // one plane per channel of the whole file, converted block by block
+    std::vector<std::vector<float>> read_planes() {
+        const size_t ch = layout.channels, step = std::max<size_t>(WavReader::BLOCK / ch, 1);
+        std::vector<std::vector<float>> planes(ch);
+        for (auto &p : planes) p.resize(size_t(frames_)); // not from a prototype: that is one more copy
+        for (uint64_t t = 0; t < frames_; t += step) {
+            size_t n = step;
+            const float *x = block(t, n);
+            for (size_t c = 0; c < ch; ++c)
+                for (size_t i = 0; i < n; ++i) planes[c][size_t(t) + i] = x[i * ch + c];
+        }
+        return planes;
+    }
+};
+
+// The whole file at path, one plane per channel: converted from a mapping
+// when path is a regular file, otherwise (a pipe, /dev/stdin) read through
+// r, which must be open on path with nothing read yet.
+inline std::vector<std::vector<float>> read_wav_planes(const std::string &path, WavReader &r) {
+    std::error_code ec;
+    if (std::filesystem::is_regular_file(path, ec)) return WavMap(path).read_planes();
+    return r.read_planes();
+}
+
+} // namespace wofl
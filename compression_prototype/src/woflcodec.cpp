@@ -3,10 +3,23 @@
 #include "mdct.hpp"
 #include "bitio.hpp"
 #include "rice.hpp"
+#include "limiter.hpp"
 #include "wav.hpp"
+#include "wavmap.hpp"
+#include "resample.hpp"
 #include "analysis.hpp"
 #include "psy.hpp"
+#include "pns.hpp"
+#include "sbr.hpp"
+#include "lossless.hpp"
 #include "bitstream.hpp"
 #include "parametric.hpp"
 #include "residual.hpp"
+#include "ratectl.hpp"
+#include "channels.hpp"
 #include "codebook.hpp"
+#include "threadpool.hpp"
+#include "spsc.hpp"
+#include "pipeline.hpp"
+#include "lowdelay.hpp"
+#include "batch.hpp"
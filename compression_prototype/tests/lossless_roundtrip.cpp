@@ -0,0 +1,108 @@
+// Lossless round trip: writes one test signal as WAV, runs it through
+// encoder --lossless and decoder, and compares the data chunks byte for
+// byte (the headers may differ, e.g. 24-bit output is always EXTENSIBLE).
+//
+//   lossless_roundtrip <encoder> <decoder> <workdir> <case>
+#include <cstdint>
+#include <cmath>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "wav.hpp"
+#include "wavmap.hpp"
+
+namespace {
+
+struct Case {
+    const char *name;
+    int bits;
+    int channels;
+    uint32_t mask;
+    size_t frames;
+    const char *options; // extra encoder options
+};
+
+// 5 s at 44.1 kHz is 430.66 hops of 512, so lengths are not hop multiples
+const Case CASES[] = {
+    {"u8_mono", 8, 1, 0, 44100 * 2 + 77, ""},
+    {"s16_mono", 16, 1, 0, 44100 * 2 + 77, ""},
+    {"s24_mono", 24, 1, 0, 44100 * 2 + 77, ""},
+    {"s16_stereo", 16, 2, 0, 44100 * 2 + 77, ""},
+    {"s24_stereo", 24, 2, 0, 44100 * 2 + 77, ""},
+    {"s16_51", 16, 6, 0x3F, 44100 + 13, ""},
+    {"s16_segmented", 16, 2, 0, 44100 * 5 + 1, "--segment=37 --threads=4"},
+    {"s16_short", 16, 2, 0, 100, ""},
+    {"s16_empty", 16, 2, 0, 0, ""},
+};
+
+// exact integer samples: a sine per channel, full-scale steps and a
+// pseudo-random low part so every bit toggles
+std::vector<float> signal(const Case &c) {
+    const double scale = double(1u << (c.bits - 1));
+    const int32_t lo = -int32_t(scale), hi = int32_t(scale) - 1;
+    std::vector<float> pcm(c.frames * c.channels);
+    uint32_t seed = 12345u;
+    for (size_t i = 0; i < c.frames; ++i) {
+        for (int ch = 0; ch < c.channels; ++ch) {
+            seed = seed * 1664525u + 1013904223u;
+            double s = 0.6 * std::sin(2.0 * 3.141592653589793 * (220.0 * (ch + 1)) * double(i) / 44100.0);
+            int32_t v = int32_t(std::lround(s * scale)) + int32_t(seed >> 24) % 17 - 8;
+            if (i % 4096 == 100) v = hi;
+            if (i % 4096 == 200) v = lo;
+            v = std::min(hi, std::max(lo, v));
+            pcm[i * c.channels + ch] = float(double(v) / scale);
+        }
+    }
+    return pcm;
+}
+
+int run(const std::string &cmd) {
+    std::cout << "+ " << cmd << std::endl;
+    return std::system(cmd.c_str());
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 5) {
+        std::cerr << "Usage: lossless_roundtrip <encoder> <decoder> <workdir> <case>" << std::endl;
+        return 2;
+    }
+    const std::string encoder = argv[1], decoder = argv[2], dir = argv[3], name = argv[4];
+    const Case *c = nullptr;
+    for (const auto &k : CASES)
+        if (name == k.name) c = &k;
+    if (!c) {
+        std::cerr << "unknown case " << name << std::endl;
+        return 2;
+    }
+
+    const std::string in = dir + "/" + name + ".wav", bin = dir + "/" + name + ".bin",
+                      out = dir + "/" + name + "_out.wav";
+    wofl::PcmFormat fmt;
+    fmt.bits = uint16_t(c->bits);
+    wofl::write_wav(in, signal(*c), 44100, c->channels, c->mask, fmt);
+
+    if (run(encoder + " " + in + " " + bin + " --lossless " + c->options) != 0 ||
+        run(decoder + " " + bin + " " + out) != 0) {
+        std::cerr << "FAIL " << name << ": encoder or decoder failed" << std::endl;
+        return 1;
+    }
+
+    wofl::WavMap a(in), b(out);
+    const size_t bytes = size_t(a.frames()) * a.channels() * a.format().bytes();
+    bool same = a.frames() == b.frames() && a.channels() == b.channels() && a.sample_rate() == b.sample_rate() &&
+                a.channel_mask() == b.channel_mask() && a.format().bits == b.format().bits &&
+                a.format().is_float == b.format().is_float &&
+                (bytes == 0 || std::memcmp(a.data(), b.data(), bytes) == 0);
+    if (!same) {
+        std::cerr << "FAIL " << name << ": decoded data differs (" << a.frames() << " -> " << b.frames()
+                  << " frames)" << std::endl;
+        return 1;
+    }
+    std::cout << "ok " << name << ": " << a.frames() << " frames bit-exact" << std::endl;
+    return 0;
+}
@@ -0,0 +1,114 @@
+// Masking model quality check: writes a pure tone as WAV, codes it with
+// the default (psy) settings and with --no-psy, decodes both at unit gain
+// and checks that the psy SNR is within PSY_TOLERANCE_DB of the --no-psy
+// one and that the level comes back. A tone's error sits on and beside
+// the partial, where nothing masks it.
+//
+//   psy_tone <encoder> <decoder> <workdir> <case>
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "wav.hpp"
+
+namespace {
+
+constexpr double PSY_TOLERANCE_DB = 3.0;
+constexpr double LEVEL_TOLERANCE_DB = 0.1;
+
+struct Case {
+    const char *name;
+    double hz;
+    double amplitude;
+    double seconds;
+    double fade; // raised-cosine fade in and out, seconds
+};
+
+const Case CASES[] = {
+    {"tone_250", 250.0, 0.05, 3.0, 0.02},
+    {"tone_440", 440.0, 0.125, 5.0, 0.0}, // like data/input.wav, hard edges
+    {"tone_1k", 1000.0, 0.5, 3.0, 0.02},
+    {"tone_3k", 3000.0, 0.25, 3.0, 0.02},
+    {"tone_6k", 6000.0, 0.5, 3.0, 0.02},
+};
+
+std::vector<float> tone(const Case &c) {
+    const double sr = 44100.0, pi = 3.141592653589793;
+    const size_t n = size_t(c.seconds * sr), f = size_t(c.fade * sr);
+    std::vector<float> pcm(n);
+    for (size_t i = 0; i < n; ++i) {
+        double g = 1.0;
+        if (i < f) g = 0.5 - 0.5 * std::cos(pi * double(i) / double(f));
+        if (n - 1 - i < f) g = 0.5 - 0.5 * std::cos(pi * double(n - 1 - i) / double(f));
+        // on the 16-bit grid, so the file holds exactly this signal
+        pcm[i] = float(std::lround(32767.0 * c.amplitude * g * std::sin(2.0 * pi * c.hz * double(i) / sr)) / 32768.0);
+    }
+    return pcm;
+}
+
+int run(const std::string &cmd) {
+    std::cout << "+ " << cmd << std::endl;
+    return std::system(cmd.c_str());
+}
+
+// SNR and level change of out against in, dB; false on a length mismatch
+bool compare(const std::vector<float> &in, const std::vector<float> &out, double &snr, double &level) {
+    if (in.size() != out.size()) return false;
+    double s = 0.0, e = 0.0, o = 0.0;
+    for (size_t i = 0; i < in.size(); ++i) {
+        s += double(in[i]) * in[i];
+        o += double(out[i]) * out[i];
+        e += (double(in[i]) - out[i]) * (double(in[i]) - out[i]);
+    }
+    snr = 10.0 * std::log10(s / std::max(e, 1e-30));
+    level = 10.0 * std::log10(std::max(o, 1e-30) / s);
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    if (argc < 5) {
+        std::cerr << "Usage: psy_tone <encoder> <decoder> <workdir> <case>" << std::endl;
+        return 2;
+    }
+    const std::string encoder = argv[1], decoder = argv[2], dir = argv[3], name = argv[4];
+    const Case *c = nullptr;
+    for (const auto &k : CASES)
+        if (name == k.name) c = &k;
+    if (!c) {
+        std::cerr << "unknown case " << name << std::endl;
+        return 2;
+    }
+
+    const std::string in = dir + "/" + name + ".wav";
+    const std::vector<float> x = tone(*c);
+    wofl::write_wav(in, x, 44100, 1);
+
+    double snr[2], level[2];
+    const char *modes[2] = {"", "--no-psy"};
+    for (int m = 0; m < 2; ++m) {
+        const std::string tag = name + (m ? "_nopsy" : "_psy");
+        const std::string bin = dir + "/" + tag + ".bin", out = dir + "/" + tag + ".wav";
+        if (run(encoder + " " + in + " " + bin + " " + modes[m]) != 0 ||
+            run(decoder + " " + bin + " " + out + " --limit") != 0) {
+            std::cerr << "FAIL " << name << ": encoder or decoder failed" << std::endl;
+            return 1;
+        }
+        if (!compare(x, wofl::read_wav(out).samples, snr[m], level[m])) {
+            std::cerr << "FAIL " << name << ": decoded length differs" << std::endl;
+            return 1;
+        }
+    }
+
+    std::cout << name << ": psy " << snr[0] << " dB (level " << level[0] << " dB), --no-psy " << snr[1] << " dB"
+              << std::endl;
+    if (snr[0] < snr[1] - PSY_TOLERANCE_DB || std::fabs(level[0]) > LEVEL_TOLERANCE_DB) {
+        std::cerr << "FAIL " << name << ": the masking model costs the tone too much" << std::endl;
+        return 1;
+    }
+    std::cout << "ok " << name << std::endl;
+    return 0;
+}
@@ -23,15 +23,30 @@ static inline int16_t fast_round_to_i16(float x) {
 struct RiffHeader { char riff[4]; uint32_t size; char wave[4]; };
 struct ChunkHeader { char id[4]; uint32_t size; };
 struct FmtPCM {
-    uint16_t audio_format;   // 1 = PCM
+    uint16_t audio_format;   // 1 = PCM, 3 = IEEE float, 0xFFFE = extensible
     uint16_t num_channels;
     uint32_t sample_rate;
     uint32_t byte_rate;
     uint16_t block_align;
-    uint16_t bits_per_sample; // 16
+    uint16_t bits_per_sample; // 8, 16, 24, 32 or 64
 };
 #pragma pack(pop)
 
+// one sample of the data chunk as float in [-1, 1): 8-bit unsigned, 16/24/32-bit
+// signed PCM (tag 1) or 32/64-bit IEEE float (tag 3), little endian
+static inline float sample_to_float(const uint8_t* p, uint16_t tag, uint16_t bits) {
+    if (tag == 3) {
+        if (bits == 32) { float v; std::memcpy(&v,p,4); return v; }
+        double v; std::memcpy(&v,p,8); return (float)v;
+    }
+    switch (bits) {
+    case 8:  return (p[0] - 128) / 128.0f;
+    case 16: { int16_t v; std::memcpy(&v,p,2); return v / 32768.0f; }
+    case 24: return (int32_t)((uint32_t)p[0]<<8 | (uint32_t)p[1]<<16 | (uint32_t)p[2]<<24) / 2147483648.0f;
+    default: { int32_t v; std::memcpy(&v,p,4); return v / 2147483648.0f; }
+    }
+}
+
 bool read_wav(const std::string& filename, WavData& out) {
     FILE* f = std::fopen(filename.c_str(), "rb");
     if (!f) return false;
@@ -42,6 +57,7 @@ bool read_wav(const std::string& filename, WavData& out) {
 
     bool have_fmt=false, have_data=false;
     FmtPCM fmt{};
+    uint16_t tag = 0; // format tag, or the subtype's for WAVE_FORMAT_EXTENSIBLE
     std::vector<uint8_t> data;
 
     while (true) {
@@ -52,41 +68,48 @@ bool read_wav(const std::string& filename, WavData& out) {
             if (ch.size < sizeof(FmtPCM)) { std::fclose(f); return false; }
             if (!read_exact(f,&fmt,sizeof(fmt))) { std::fclose(f); return false; }
             have_fmt = true;
-            if (ch.size > sizeof(FmtPCM))
-                if (!skip_bytes(f, ch.size - sizeof(FmtPCM))) { std::fclose(f); return false; }
+            tag = fmt.audio_format;
+            uint32_t rest = ch.size - (uint32_t)sizeof(FmtPCM) + (ch.size & 1);
+            if (tag == 0xFFFE && ch.size >= 40) {
+                uint8_t ext[24]; // cbSize, valid bits, channel mask, subtype GUID
+                if (!read_exact(f, ext, sizeof(ext))) { std::fclose(f); return false; }
+                tag = (uint16_t)(ext[8] | ext[9] << 8);
+                rest -= sizeof(ext);
+            }
+            if (rest && !skip_bytes(f, rest)) { std::fclose(f); return false; }
         } else if (!std::memcmp(ch.id,"data",4)) {
             data.resize(ch.size);
             if (ch.size && !read_exact(f, data.data(), ch.size)) { std::fclose(f); return false; }
             have_data = true;
+            if ((ch.size & 1) && !skip_bytes(f, 1)) break;
         } else {
-            if (!skip_bytes(f, ch.size)) { std::fclose(f); return false; }
+            if (!skip_bytes(f, ch.size + (ch.size & 1))) { std::fclose(f); return false; }
         }
     }
     std::fclose(f);
 
     if (!have_fmt || !have_data) return false;
-    if (fmt.audio_format != 1 || fmt.bits_per_sample != 16) return false;
+    const uint16_t bits = fmt.bits_per_sample;
+    bool pcm_ok = tag == 1 && (bits == 8 || bits == 16 || bits == 24 || bits == 32);
+    bool float_ok = tag == 3 && (bits == 32 || bits == 64);
+    if ((!pcm_ok && !float_ok) || fmt.num_channels == 0) return false;
 
     out.sample_rate  = (int)fmt.sample_rate;
     out.num_channels = (int)fmt.num_channels;
 
-    size_t total_samples = data.size() / 2; // int16 count
-    const int16_t* src = reinterpret_cast<const int16_t*>(data.data());
-    size_t frames = total_samples / fmt.num_channels;
+    const size_t width = bits / 8;
+    const size_t frame_bytes = width * fmt.num_channels;
+    size_t frames = data.size() / frame_bytes;
     out.samples.resize(frames);
 
-    if (fmt.num_channels == 1) {
-        for (size_t i=0;i<frames;i++)
-            out.samples[i] = src[i] / 32768.0f;
-    } else {
-        for (size_t i=0;i<frames;i++) {
-            int acc = 0;
-            for (int ch=0; ch<fmt.num_channels; ++ch)
-                acc += src[i*fmt.num_channels + ch];
-            out.samples[i] = (acc / float(fmt.num_channels)) / 32768.0f;
-        }
-        out.num_channels = 1;
+    for (size_t i=0;i<frames;i++) {
+        const uint8_t* p = data.data() + i*frame_bytes;
+        float acc = 0.0f;
+        for (int ch=0; ch<fmt.num_channels; ++ch)
+            acc += sample_to_float(p + ch*width, tag, bits);
+        out.samples[i] = acc / float(fmt.num_channels);
     }
+    out.num_channels = 1;
     return true;
 }
 
@@ -118,10 +141,15 @@ bool write_wav(const std::string& filename, const WavData& in) {
     if (!write_exact(f, dataid, 4)) { std::fclose(f); return false; }
     if (!write_exact(f, &data_bytes, 4)) { std::fclose(f); return false; }
 
-    for (float s : in.samples) {
-        float cl = std::min(1.0f, std::max(-1.0f, s));
-        int16_t v = fast_round_to_i16(cl * 32767.0f);
-        if (!write_exact(f,&v,sizeof(v))) { std::fclose(f); return false; }
+    // convert a block at a time into a staging buffer, one fwrite per block
+    std::vector<int16_t> staging(16384);
+    for (size_t i = 0; i < in.samples.size(); i += staging.size()) {
+        size_t n = std::min(staging.size(), in.samples.size() - i);
+        for (size_t k = 0; k < n; ++k) {
+            float cl = std::min(1.0f, std::max(-1.0f, in.samples[i + k]));
+            staging[k] = fast_round_to_i16(cl * 32767.0f);
+        }
+        if (!write_exact(f, staging.data(), n * sizeof(int16_t))) { std::fclose(f); return false; }
     }
     std::fclose(f);
     return true;